@@ -0,0 +1,651 @@
+/*
+ * Benchmarks mapping and extraction with bookcoder.
+ *
+ * Synthetic book files and original files are generated for several kinds of data and at several
+ * sizes, and bookcoder is run on them for every combination of book_file_buffer size and flags
+ * that is asked for. Each run is timed from start to exit and its peak memory use is taken from
+ * the kernel when it is reaped, so the numbers cover the whole program as it is really used.
+ * Extracted files are compared with the originals so that a fast but broken build is caught too.
+ *
+ * The kinds of data are:
+ *
+ * uniform - Every byte value equally likely, like compressed or encrypted files.
+ * text - Words from a small vocabulary with a Zipf distribution, separated by spaces and
+ * punctuation, like plain text.
+ * lowentropy - Only 16 different byte values, equally likely.
+ * skewed - Every byte value, but each one a little less likely than the one before it, so that a 
+ * few bytes are very common and many are rare.
+ *
+ * Each book file is book-ratio times the size of its original file, and both come from the same
+ * distribution with different seeds so the original can be mapped to the book.
+ *
+ */
+
+#define PRINT_SYS_ERROR(errCode) \
+    { \
+        fprintf(stderr, "%s:%s:%d: %s\n", __FILE__, __func__, __LINE__, strerror(errCode)); \
+    }
+
+#define PRINT_FILE_ERROR(fileName, errCode) \
+    { \
+        fprintf(stderr, "%s: %s (Line: %i)\n", fileName, strerror(errCode), __LINE__); \
+    }
+
+#define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE
+
+#define MAX_LIST_ITEMS 32
+#define MAX_ARGS 64
+#define VOCABULARY_SIZE 2048
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <ctype.h>
+#include <math.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+typedef uint8_t byte_t;
+
+struct workloadStruct {
+    const char *name;
+    void (*generate)(byte_t *buffer, size_t size, uint64_t seed);
+};
+
+struct runResultStruct {
+    bool succeeded;
+    double seconds;
+    long peakRssKb;
+};
+
+struct optionsStruct {
+    char bookcoderPath[PATH_MAX];
+    char workDir[PATH_MAX];
+    char *workloadNames[MAX_LIST_ITEMS];
+    int workloadCount;
+    size_t orgFilSizes[MAX_LIST_ITEMS];
+    int orgFilSizeCount;
+    char *bkFilBufSizes[MAX_LIST_ITEMS];
+    int bkFilBufSizeCount;
+    char *flagSets[MAX_LIST_ITEMS];
+    int flagSetCount;
+    char *extractFlags;
+    int bookRatio;
+    int repeatCount;
+    bool keepFiles;
+    bool csvOutput;
+};
+
+/* xorshift64* so that the same data is generated on every host */
+uint64_t nextRandom(uint64_t *state)
+{
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545F4914F6CDD1DULL;
+}
+
+void generateUniform(byte_t *buffer, size_t size, uint64_t seed)
+{
+    for (size_t i = 0; i < size; i++) {
+        buffer[i] = nextRandom(&seed) >> 56;
+    }
+}
+
+void generateLowEntropy(byte_t *buffer, size_t size, uint64_t seed)
+{
+    for (size_t i = 0; i < size; i++) {
+        buffer[i] = 'A' + (nextRandom(&seed) >> 60);
+    }
+}
+
+void generateSkewed(byte_t *buffer, size_t size, uint64_t seed)
+{
+    /* The chance of each byte value falls by half every 32 values, so byte 0 is about 250 times 
+     * as common as byte 255
+     */
+    double cumulative[256];
+    double total = 0;
+    for (int i = 0; i < 256; i++) {
+        total += pow(0.5, i / 32.0);
+        cumulative[i] = total;
+    }
+    
+    for (size_t i = 0; i < size; i++) {
+        double pick = (nextRandom(&seed) >> 11) * (1.0 / 9007199254740992.0) * total;
+        int lo = 0, hi = 255;
+        while (lo < hi) {
+            int mid = (lo + hi) / 2;
+            if (cumulative[mid] < pick) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        buffer[i] = lo;
+    }
+}
+
+void generateText(byte_t *buffer, size_t size, uint64_t seed)
+{
+    static const char letters[] = "eeeeeeeeeeeetttttttttaaaaaaaaooooooooiiiiiiinnnnnnnsssssshhhhhhrrrrrrddddllllcccuuummwwffggyyppbbvkjxqz";
+    static const char punctuation[] = ",,,,....;:!?\n";
+    char vocabulary[VOCABULARY_SIZE][12];
+    double cumulative[VOCABULARY_SIZE];
+    double total = 0;
+    
+    /* The vocabulary is always the same, only the order of words depends on the seed */
+    uint64_t vocabularySeed = 0x9E3779B97F4A7C15ULL;
+    for (int i = 0; i < VOCABULARY_SIZE; i++) {
+        int wordLength = 1 + nextRandom(&vocabularySeed) % 10;
+        for (int j = 0; j < wordLength; j++) {
+            vocabulary[i][j] = letters[nextRandom(&vocabularySeed) % (sizeof(letters) - 1)];
+        }
+        vocabulary[i][wordLength] = '\0';
+        
+        total += 1.0 / (i + 1);
+        cumulative[i] = total;
+    }
+    
+    size_t i = 0;
+    bool startOfSentence = true;
+    while (i < size) {
+        double pick = (nextRandom(&seed) >> 11) * (1.0 / 9007199254740992.0) * total;
+        int lo = 0, hi = VOCABULARY_SIZE - 1;
+        while (lo < hi) {
+            int mid = (lo + hi) / 2;
+            if (cumulative[mid] < pick) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        
+        for (const char *c = vocabulary[lo]; *c != '\0' && i < size; c++) {
+            buffer[i++] = startOfSentence ? toupper(*c) : *c;
+            startOfSentence = false;
+        }
+        
+        if (i < size && nextRandom(&seed) % 8 == 0) {
+            buffer[i] = punctuation[nextRandom(&seed) % (sizeof(punctuation) - 1)];
+            startOfSentence = buffer[i] != ',' && buffer[i] != ';' && buffer[i] != ':';
+            i++;
+        }
+        if (i < size && (i == 0 || buffer[i - 1] != '\n')) {
+            buffer[i++] = ' ';
+        }
+    }
+}
+
+struct workloadStruct workloads[] = {
+    {"uniform",    generateUniform},
+    {"text",       generateText},
+    {"lowentropy", generateLowEntropy},
+    {"skewed",     generateSkewed},
+};
+
+#define WORKLOAD_COUNT (sizeof(workloads) / sizeof(workloads[0]))
+
+/* Parses a size with an optional b, k, m or g suffix. Returns 0 if it is not a valid size. */
+size_t parseSize(const char *value)
+{
+    char *end;
+    unsigned long long size = strtoull(value, &end, 10);
+    
+    if (end == value) {
+        return 0;
+    }
+    
+    switch (tolower(*end)) {
+    case '\0':
+    case 'b':
+        break;
+    case 'k':
+        size *= 1024;
+        break;
+    case 'm':
+        size *= 1024 * 1024;
+        break;
+    case 'g':
+        size *= 1024 * 1024 * 1024;
+        break;
+    default:
+        return 0;
+    }
+    
+    return size;
+}
+
+/* Splits a comma separated list in place. Returns the number of items, or -1 if there are too many. */
+int splitList(char *list, char **items)
+{
+    int count = 0;
+    
+    for (char *item = strtok(list, ","); item != NULL; item = strtok(NULL, ",")) {
+        if (count == MAX_LIST_ITEMS) {
+            return -1;
+        }
+        items[count++] = item;
+    }
+    
+    return count;
+}
+
+/* Appends the space separated words of flags to args */
+void appendFlags(char **args, int *argCount, const char *flags)
+{
+    if (flags == NULL || strcmp(flags, "none") == 0) {
+        return;
+    }
+    
+    char *flagsCopy = strdup(flags);
+    if (flagsCopy == NULL) {
+        PRINT_SYS_ERROR(errno);
+        exit(EXIT_FAILURE);
+    }
+    
+    for (char *word = strtok(flagsCopy, " "); word != NULL && *argCount < MAX_ARGS - 1; word = strtok(NULL, " ")) {
+        args[(*argCount)++] = strdup(word);
+    }
+    
+    free(flagsCopy);
+}
+
+void freeArgs(char **args, int argCount)
+{
+    for (int i = 1; i < argCount; i++) {
+        free(args[i]);
+    }
+}
+
+void writeFile(const char *fileName, byte_t *buffer, size_t size)
+{
+    FILE *file = fopen(fileName, "wb");
+    if (file == NULL) {
+        PRINT_FILE_ERROR(fileName, errno);
+        exit(EXIT_FAILURE);
+    }
+    
+    if (fwrite(buffer, 1, size, file) != size || fclose(file) != 0) {
+        PRINT_FILE_ERROR(fileName, errno);
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* Returns true if the file holds exactly size bytes matching buffer */
+bool fileMatches(const char *fileName, byte_t *buffer, size_t size)
+{
+    FILE *file = fopen(fileName, "rb");
+    if (file == NULL) {
+        return false;
+    }
+    
+    byte_t chunk[65536];
+    size_t position = 0;
+    size_t bytesRead;
+    bool matches = true;
+    
+    while ((bytesRead = fread(chunk, 1, sizeof(chunk), file)) > 0) {
+        if (position + bytesRead > size || memcmp(chunk, buffer + position, bytesRead) != 0) {
+            matches = false;
+            break;
+        }
+        position += bytesRead;
+    }
+    
+    fclose(file);
+    
+    return matches && position == size;
+}
+
+/* Runs bookcoder with args and its output thrown away, timing it and taking its peak resident
+ * set size once it exits. The quickest of repeatCount runs is kept.
+ */
+void runBookcoder(char **args, int repeatCount, struct runResultStruct *result)
+{
+    result->succeeded = true;
+    result->seconds = 0;
+    result->peakRssKb = 0;
+    
+    for (int run = 0; run < repeatCount; run++) {
+        struct timespec start, end;
+        struct rusage usage;
+        int status;
+        
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        
+        pid_t pid = fork();
+        if (pid == -1) {
+            PRINT_SYS_ERROR(errno);
+            exit(EXIT_FAILURE);
+        } else if (pid == 0) {
+            int devNull = open("/dev/null", O_WRONLY);
+            if (devNull != -1) {
+                dup2(devNull, STDOUT_FILENO);
+                dup2(devNull, STDERR_FILENO);
+            }
+            execv(args[0], args);
+            _exit(127);
+        }
+        
+        if (wait4(pid, &status, 0, &usage) == -1) {
+            PRINT_SYS_ERROR(errno);
+            exit(EXIT_FAILURE);
+        }
+        
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            result->succeeded = false;
+            return;
+        }
+        
+        double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+        if (run == 0 || seconds < result->seconds) {
+            result->seconds = seconds;
+        }
+        if (usage.ru_maxrss > result->peakRssKb) {
+            result->peakRssKb = usage.ru_maxrss;
+        }
+    }
+}
+
+void printResult(struct runResultStruct *result, size_t orgFilSize, struct optionsStruct *optSt)
+{
+    if (!result->succeeded) {
+        printf(optSt->csvOutput ? ",,," : " %10s %9s %9s", "failed", "-", "-");
+        return;
+    }
+    
+    double megabytesPerSecond = orgFilSize / result->seconds / (1024 * 1024);
+    double nanosecondsPerByte = result->seconds * 1e9 / orgFilSize;
+    double peakRssMb = result->peakRssKb / 1024.0;
+    
+    printf(optSt->csvOutput ? ",%.2f,%.2f,%.1f" : " %10.2f %9.2f %9.1f", megabytesPerSecond, nanosecondsPerByte, peakRssMb);
+}
+
+void benchmarkWorkload(struct workloadStruct *workload, size_t orgFilSize, struct optionsStruct *optSt)
+{
+    char bkFilName[PATH_MAX + 64], orgFilName[PATH_MAX + 64], bkCdFilName[PATH_MAX + 64], extrFilName[PATH_MAX + 64];
+    size_t bkFilSize = orgFilSize * optSt->bookRatio;
+    
+    snprintf(bkFilName, sizeof(bkFilName), "%s/%s-%zu.book", optSt->workDir, workload->name, orgFilSize);
+    snprintf(orgFilName, sizeof(orgFilName), "%s/%s-%zu.orig", optSt->workDir, workload->name, orgFilSize);
+    snprintf(bkCdFilName, sizeof(bkCdFilName), "%s/%s-%zu.code", optSt->workDir, workload->name, orgFilSize);
+    snprintf(extrFilName, sizeof(extrFilName), "%s/%s-%zu.extracted", optSt->workDir, workload->name, orgFilSize);
+    
+    byte_t *bkFilBuffer = malloc(bkFilSize);
+    byte_t *orgFilBuffer = malloc(orgFilSize);
+    if (bkFilBuffer == NULL || orgFilBuffer == NULL) {
+        PRINT_SYS_ERROR(errno);
+        exit(EXIT_FAILURE);
+    }
+    
+    workload->generate(bkFilBuffer, bkFilSize, 0x0123456789ABCDEFULL ^ bkFilSize);
+    workload->generate(orgFilBuffer, orgFilSize, 0xFEDCBA9876543210ULL ^ orgFilSize);
+    writeFile(bkFilName, bkFilBuffer, bkFilSize);
+    writeFile(orgFilName, orgFilBuffer, orgFilSize);
+    free(bkFilBuffer);
+    
+    for (int b = 0; b < optSt->bkFilBufSizeCount; b++) {
+        char bufferOption[128];
+        snprintf(bufferOption, sizeof(bufferOption), "book_file_buffer=%s", optSt->bkFilBufSizes[b]);
+        
+        for (int f = 0; f < optSt->flagSetCount; f++) {
+            char *args[MAX_ARGS] = {optSt->bookcoderPath};
+            int argCount = 1;
+            struct runResultStruct mapResult, extractResult = {0};
+            
+            appendFlags(args, &argCount, "-m -b");
+            args[argCount++] = strdup(bkFilName);
+            appendFlags(args, &argCount, "-o");
+            args[argCount++] = strdup(orgFilName);
+            appendFlags(args, &argCount, "-f");
+            args[argCount++] = strdup(bkCdFilName);
+            appendFlags(args, &argCount, "-s");
+            args[argCount++] = strdup(bufferOption);
+            appendFlags(args, &argCount, optSt->flagSets[f]);
+            args[argCount] = NULL;
+            
+            runBookcoder(args, optSt->repeatCount, &mapResult);
+            freeArgs(args, argCount);
+            
+            bool extractedMatches = false;
+            if (mapResult.succeeded) {
+                argCount = 1;
+                appendFlags(args, &argCount, "-e -b");
+                args[argCount++] = strdup(bkFilName);
+                appendFlags(args, &argCount, "-c");
+                args[argCount++] = strdup(bkCdFilName);
+                appendFlags(args, &argCount, "-f");
+                args[argCount++] = strdup(extrFilName);
+                appendFlags(args, &argCount, "-s");
+                args[argCount++] = strdup(bufferOption);
+                appendFlags(args, &argCount, optSt->extractFlags);
+                args[argCount] = NULL;
+                
+                runBookcoder(args, optSt->repeatCount, &extractResult);
+                freeArgs(args, argCount);
+                
+                extractedMatches = extractResult.succeeded && fileMatches(extrFilName, orgFilBuffer, orgFilSize);
+            }
+            
+            printf(optSt->csvOutput ? "%s,%zu,%s,%s" : "%-10s %10zu %8s %-16s", workload->name, orgFilSize, optSt->bkFilBufSizes[b], optSt->flagSets[f]);
+            printResult(&mapResult, orgFilSize, optSt);
+            printResult(&extractResult, orgFilSize, optSt);
+            if (mapResult.succeeded) {
+                printf(optSt->csvOutput ? ",%s\n" : " %s\n", extractedMatches ? "ok" : "MISMATCH");
+            } else {
+                printf(optSt->csvOutput ? ",%s\n" : " %s\n", "unmappable");
+            }
+            fflush(stdout);
+            
+            remove(bkCdFilName);
+            remove(extrFilName);
+        }
+    }
+    
+    free(orgFilBuffer);
+    
+    if (!optSt->keepFiles) {
+        remove(bkFilName);
+        remove(orgFilName);
+    }
+}
+
+void printHelp(char *argv)
+{
+    fprintf(stderr,
+"Syntax:\n%s [-b 'bookcoder'] [-w 'workloads'] [-S 'sizes'] [-R 'ratio'] [-s 'buffer sizes'] [-f 'flag sets'] [-x 'flags'] [-n 'runs'] [-d 'directory'] [-k] [-c]\n\
+\nOptions:\
+\n\t-b,--bookcoder 'path' - bookcoder binary to benchmark. Defaults to ./bookcoder.\n\
+\n\t-w,--workloads 'list' - Comma separated list of kinds of data to generate, out of uniform, text, lowentropy and skewed. Defaults to all of them.\n\
+\n\t-S,--sizes 'list' - Comma separated list of original file sizes. Suffix with 'b' for bytes, 'k' for kilobytes, 'm' for megabytes or 'g' for gigabytes. Defaults to 1m,8m.\n\
+\n\t-R,--book-ratio 'n' - Make each book file n times the size of its original file. Defaults to 4.\n\
+\n\t-s,--buffer-sizes 'list' - Comma separated list of book_file_buffer sizes to run with, as given to bookcoder -s. Defaults to 64k,1m.\n\
+\n\t-f,--flag-sets 'list' - Comma separated list of flags to map with, with the flags in each set separated by spaces, and 'none' for no flags. Defaults to none,-r,--duplicates.\n\
+\n\t-x,--extract-flags 'flags' - Space separated flags to extract with, such as '-g -t 4'.\n\
+\n\t-n,--runs 'n' - Run each map and extraction n times and keep the quickest. Defaults to 3.\n\
+\n\t-d,--directory 'directory' - Directory to generate files in. Defaults to a new directory in /tmp.\n\
+\n\t-k,--keep - Keep the generated book and original files afterward.\n\
+\n\t-c,--csv - Print results as comma separated values.\n\
+\nResults are given for map and then extract as MB/s and ns/byte of the original file, and peak resident set size in MB.\n\
+", argv);
+}
+
+void parseOptions(int argc, char *argv[], struct optionsStruct *optSt)
+{
+    int c;
+    int errflg = 0;
+    static char defaultSizes[] = "1m,8m";
+    static char defaultBufSizes[] = "64k,1m";
+    static char defaultFlagSets[] = "none,-r,--duplicates";
+    char *sizeList = defaultSizes;
+    
+    snprintf(optSt->bookcoderPath, PATH_MAX, "./bookcoder");
+    optSt->bookRatio = 4;
+    optSt->repeatCount = 3;
+    optSt->bkFilBufSizeCount = splitList(defaultBufSizes, optSt->bkFilBufSizes);
+    optSt->flagSetCount = splitList(defaultFlagSets, optSt->flagSets);
+    
+    while (1) {
+        int option_index = 0;
+        static struct option long_options[] = {
+            {"bookcoder",     required_argument, 0,'b' },
+            {"workloads",     required_argument, 0,'w' },
+            {"sizes",         required_argument, 0,'S' },
+            {"book-ratio",    required_argument, 0,'R' },
+            {"buffer-sizes",  required_argument, 0,'s' },
+            {"flag-sets",     required_argument, 0,'f' },
+            {"extract-flags", required_argument, 0,'x' },
+            {"runs",          required_argument, 0,'n' },
+            {"directory",     required_argument, 0,'d' },
+            {"keep",          no_argument,       0,'k' },
+            {"csv",           no_argument,       0,'c' },
+            {"help",          no_argument,       0,'h' },
+            {0,               0,                 0, 0  }
+        };
+        
+        c = getopt_long(argc, argv, "b:w:S:R:s:f:x:n:d:kch", long_options, &option_index);
+        if (c == -1)
+            break;
+        
+        switch (c) {
+        
+        case 'b':
+            snprintf(optSt->bookcoderPath, PATH_MAX, "%s", optarg);
+        break;
+        case 'w':
+            optSt->workloadCount = splitList(optarg, optSt->workloadNames);
+            for (int i = 0; i < optSt->workloadCount; i++) {
+                size_t w;
+                for (w = 0; w < WORKLOAD_COUNT && strcmp(optSt->workloadNames[i], workloads[w].name) != 0; w++);
+                if (w == WORKLOAD_COUNT) {
+                    fprintf(stderr, "Unknown workload '%s'\n", optSt->workloadNames[i]);
+                    errflg++;
+                }
+            }
+        break;
+        case 'S':
+            sizeList = optarg;
+        break;
+        case 'R':
+            optSt->bookRatio = atoi(optarg);
+            if (optSt->bookRatio < 1) {
+                fprintf(stderr, "Book ratio must be at least 1\n");
+                errflg++;
+            }
+        break;
+        case 's':
+            optSt->bkFilBufSizeCount = splitList(optarg, optSt->bkFilBufSizes);
+        break;
+        case 'f':
+            optSt->flagSetCount = splitList(optarg, optSt->flagSets);
+        break;
+        case 'x':
+            optSt->extractFlags = optarg;
+        break;
+        case 'n':
+            optSt->repeatCount = atoi(optarg);
+            if (optSt->repeatCount < 1) {
+                fprintf(stderr, "Number of runs must be at least 1\n");
+                errflg++;
+            }
+        break;
+        case 'd':
+            snprintf(optSt->workDir, PATH_MAX, "%s", optarg);
+        break;
+        case 'k':
+            optSt->keepFiles = true;
+        break;
+        case 'c':
+            optSt->csvOutput = true;
+        break;
+        case 'h':
+            printHelp(argv[0]);
+            exit(EXIT_SUCCESS);
+        break;
+        case '?':
+            errflg++;
+        break;
+        }
+    }
+    
+    char *sizeStrings[MAX_LIST_ITEMS];
+    optSt->orgFilSizeCount = splitList(sizeList, sizeStrings);
+    for (int i = 0; i < optSt->orgFilSizeCount; i++) {
+        optSt->orgFilSizes[i] = parseSize(sizeStrings[i]);
+        if (optSt->orgFilSizes[i] == 0) {
+            fprintf(stderr, "Invalid size '%s'\n", sizeStrings[i]);
+            errflg++;
+        }
+    }
+    
+    if (optSt->workloadCount < 0 || optSt->orgFilSizeCount < 0 || optSt->bkFilBufSizeCount < 0 || optSt->flagSetCount < 0) {
+        fprintf(stderr, "At most %i items can be given in a list\n", MAX_LIST_ITEMS);
+        errflg++;
+    }
+    
+    if (access(optSt->bookcoderPath, X_OK) != 0) {
+        PRINT_FILE_ERROR(optSt->bookcoderPath, errno);
+        errflg++;
+    }
+    
+    if (errflg) {
+        printHelp(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    struct optionsStruct optSt = {0};
+    bool madeWorkDir = false;
+    
+    parseOptions(argc, argv, &optSt);
+    
+    if (optSt.workDir[0] == '\0') {
+        snprintf(optSt.workDir, PATH_MAX, "/tmp/bookcoder-bench-XXXXXX");
+        if (mkdtemp(optSt.workDir) == NULL) {
+            PRINT_SYS_ERROR(errno);
+            exit(EXIT_FAILURE);
+        }
+        madeWorkDir = true;
+    }
+    
+    if (optSt.csvOutput) {
+        printf("workload,original_bytes,book_file_buffer,flags,map_mb_s,map_ns_byte,map_peak_rss_mb,extract_mb_s,extract_ns_byte,extract_peak_rss_mb,result\n");
+    } else {
+        printf("%-10s %10s %8s %-16s %10s %9s %9s %10s %9s %9s %s\n", "workload", "bytes", "buffer", "flags", "map MB/s", "ns/byte", "RSS MB", "extr MB/s", "ns/byte", "RSS MB", "result");
+    }
+    
+    for (size_t w = 0; w < WORKLOAD_COUNT; w++) {
+        bool selected = optSt.workloadCount == 0;
+        for (int i = 0; i < optSt.workloadCount; i++) {
+            selected |= strcmp(optSt.workloadNames[i], workloads[w].name) == 0;
+        }
+        if (!selected) {
+            continue;
+        }
+        
+        for (int s = 0; s < optSt.orgFilSizeCount; s++) {
+            benchmarkWorkload(&workloads[w], optSt.orgFilSizes[s], &optSt);
+        }
+    }
+    
+    if (madeWorkDir && !optSt.keepFiles) {
+        rmdir(optSt.workDir);
+    }
+    
+    return EXIT_SUCCESS;
+}
@@ -14,17 +14,17 @@
  * perhaps in a public library, and tell Bob which book was used and where to find it. Similarly, 
  * the digital version could use a file that is widely mirrored online to serve as the book file.
  * 
- * The offsets from the book file are written as 32-bit integers. Book files that are larger than 4 
- * GB can still be used, since bytes can still be mapped to an offset within the 32-bit range. 
- * Unfortunately, this also means that for every byte of the original file, 4 bytes are stored 
- * making the book code 4 times as large as the original file. Fortunately, because most of the 
- * least-significant bits of the 32-bit integers will be null, most of those 4 bytes will also 
- * be null and heavily compressible.
+ * The offsets from the book file are written as 32-bit integers by default. Book files that are 
+ * larger than 4 GB can still be used, since bytes can still be mapped to an offset within the 
+ * 32-bit range. Unfortunately, this also means that for every byte of the original file, 4 bytes 
+ * are stored making the book code 4 times as large as the original file. Fortunately, because 
+ * most of the least-significant bits of the 32-bit integers will be null, most of those 4 bytes 
+ * will also be null and heavily compressible.
  * 
- * If 32-bit integers are not sufficient to map offset sizes required, the code can be modified to
- * change the uoffset_t and offset_t types to use 64-bit integers instead of 32-bit integers. This
- * will of course result in book code files that are 8 times larger instead of 4. In my testing I 
- * have not found this necesary, so have restricted it to 32-bit integers.
+ * If 32-bit integers are not sufficient to map offset sizes required, offsets can be written as 
+ * 40, 48 or 64-bit integers instead so that all of a larger book file can be used. Offsets are 
+ * always held in memory as 64-bit integers, and only packed into the chosen width when the book 
+ * code is written, which is recorded in the book code header so it can be unpacked again.
  * 
  */
  
@@ -50,6 +50,102 @@
 /* This defines a 1 MB buffer to be used by default. */
 #define DEFAULT_BUFFER_SIZE 1024 * 1024
 
+/* Book codes in any format but the original raw one begin with a header starting with these 
+ * bytes, followed by the header version, the format of the offsets, how the rest of the book 
+ * code is compressed and the width of raw offsets in bits
+ */
+#define BOOK_CODE_MAGIC "BKCD"
+#define BOOK_CODE_VERSION 1
+#define BOOK_CODE_HEADER_SIZE 8
+
+/* Book codes written as a container have header version 2, and the header is followed by the 
+ * sizes of the original and book files, their hashes and the number of offsets in each block. 
+ * Every block can be decoded without the ones before it. The blocks are followed by an index of 
+ * where each one starts and the checksums of its bytes and of the bytes of the original file it 
+ * holds, which is found from the footer at the very end.
+ */
+#define BOOK_CODE_CONTAINER_VERSION 2
+#define BLOCK_INDEX_MAGIC "BKCI"
+
+/* Other book codes with a header have header version 3, and the header is followed by the size 
+ * and hash of the book file, so that extracting with the wrong one is caught as it is with a 
+ * container. Version 1 headers written before that are still read, without the check.
+ */
+#define BOOK_CODE_BOOK_VERSION 3
+
+/* The most bytes a zigzag encoded delta between two offsets can take up as a LEB128 varint, 
+ * which is 7 bits of the delta per byte plus a bit for its sign
+ */
+#define MAX_VARINT_BYTES ((sizeof(uoffset_t) * CHAR_BIT + 1 + 6) / 7)
+
+/* Width in bits of the offsets in the raw format unless another is chosen, and the only width 
+ * book codes without a header can have
+ */
+#define DEFAULT_OFFSET_WIDTH 32
+
+/* Compressed raw offsets are shuffled in blocks of this many offsets, so that the lowest byte of 
+ * every offset in the block comes first, then the next byte of every offset and so on
+ */
+#define SHUFFLE_BLOCK_OFFSETS 65536
+
+/* The unused position bits have a level with a bit for every position in the book file buffer 
+ * and a level above it with a bit for every word below it that has any bits set, and so on up to 
+ * a single word. Six levels of 64 bit words cover a buffer of up to 64^6 bytes.
+ */
+#define UNUSED_BITS_MAX_LEVELS 6
+
+/* A byte value is only looked up in its position list if its positions in the book file buffer 
+ * are on average at least this many bytes apart. memchr gets to closer ones sooner than the list 
+ * can be searched, since each list is only visited once every few hundred bytes and is cold by then.
+ */
+#define POSITION_LIST_MIN_GAP 4096
+
+/* A book index file begins with a header starting with these bytes, followed by a record for 
+ * every buffer of the book file that mapping with -r can load. Each record holds where the buffer 
+ * starts in the book file, a hash of the buffer, where the list of each byte value starts, 
+ * padding to keep the positions aligned, and the positions themselves.
+ */
+#define BOOK_INDEX_MAGIC "BKIX"
+#define BOOK_INDEX_VERSION 2
+#define BOOK_INDEX_RECORD_HEADER_SIZE (2 * sizeof(uint64_t) + 257 * sizeof(uint32_t) + sizeof(uint32_t))
+
+/* Number of offsets in each block of a book code container. It is a multiple of 
+ * SHUFFLE_BLOCK_OFFSETS so that every block starts with a fresh shuffle block.
+ */
+#define BLOCK_OFFSETS (1024 * 1024)
+
+/* Analyzing a book file histograms it in blocks of this many bytes, which is small enough for the 
+ * counts of a block to fit in 32 bits and for a block to stay in cache when it has to be gone 
+ * through again byte by byte
+ */
+#define ANALYSIS_BLOCK_SIZE (64 * 1024)
+
+/* Reading and writing are only handed off to other threads while mapping when buffers are at 
+ * least this large, since handing off smaller ones costs more than it saves
+ */
+#define BACKGROUND_IO_MIN_BUFFER_SIZE (256 * 1024)
+
+/* Number of buffers in each ring between the stages of the mapping pipeline */
+#define PIPELINE_SLOTS 3
+
+/* A sliding window maps a run of the original file this many times its own size before it slides 
+ * on, so the window moves along the book at a quarter of the pace of the original and each part of 
+ * the original spans little more of the book than the window does
+ */
+#define SLIDING_WINDOW_RUN 4
+
+/* Extraction locality is measured as the span of the book file covered by each block of this 
+ * many offsets, the same as the default book_code_buffer
+ */
+#define LOCALITY_BLOCK_OFFSETS (1024 * 1024)
+
+/* Files are hashed in chunks of this many bytes, each by whichever thread gets to it first */
+#define HASH_CHUNK_SIZE (4 * 1024 * 1024)
+
+/* With io_uring, extraction keeps up to this many reads of a page of the book file in flight */
+#define IO_URING_QUEUE_DEPTH 128
+#define IO_URING_PAGE_SIZE 4096
+
 #include <errno.h>
 #include <stdbool.h>
 #include <stdint.h>
@@ -61,20 +157,187 @@
 #include <getopt.h>
 #include <ctype.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <lzma.h>
+
+/* Extraction can read the book file through io_uring on Linux when the kernel headers have it. 
+ * It is set up with system calls directly, so liburing isn't needed.
+ */
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
+#endif
+
+/* Blocks of a container are checked with CRC-32C, which x86-64 processors with SSE 4.2 and ARM 
+ * processors with the CRC extension have instructions for. On x86-64 the instruction is only used 
+ * once the processor running it is found to have it, so the same build still runs anywhere.
+ */
+#if defined(__x86_64__) && defined(__GNUC__)
+#define HAVE_CRC32C_SSE42
+#include <nmmintrin.h>
+#elif defined(__ARM_FEATURE_CRC32)
+#define HAVE_CRC32C_ARM
+#include <arm_acle.h>
+#endif
 
-typedef uint32_t uoffset_t;
-typedef int32_t offset_t;
+typedef uint64_t uoffset_t;
+typedef int64_t offset_t;
 typedef uint8_t byte_t;
 
+enum bookCodeFormat {
+    BOOK_CODE_RAW = 0,
+    BOOK_CODE_VARINT
+};
+
+enum bookCodeCompression {
+    BOOK_CODE_UNCOMPRESSED = 0,
+    BOOK_CODE_XZ
+};
+
+/* The header of a book index file. The hash of the whole book file identifies which book the 
+ * index belongs to, while the hash in each record is checked as its buffer is loaded. There is a 
+ * record for the first buffer of each of the threadCount slices the book file is split into.
+ */
+struct bookIndexHeaderStruct {
+    char magic[4];
+    uint32_t version;
+    uint64_t bkFilSize;
+    uint64_t bkFilBufSize;
+    uint64_t bufferCount;
+    uint64_t bkFilHash;
+    uint64_t threadCount;
+    byte_t reserved[16];
+};
+
+/* What follows a version 3 book code header */
+struct bookCodeBookStruct {
+    uint64_t bkFilSize;
+    uint64_t bkFilHash;
+};
+
+/* What follows the header of a book code container */
+struct bookCodeContainerStruct {
+    uint64_t orgFilSize;
+    uint64_t bkFilSize;
+    uint64_t bkFilHash;
+    uint64_t blockOffsets;
+    uint64_t orgFilHash;
+    byte_t reserved[24];
+};
+
+/* The chunks of a file being hashed by several threads, and the hash of each one */
+struct hashPoolStruct {
+    int fileDescriptor;
+    uint64_t fileSize;
+    uint64_t chunkCount;
+    atomic_uint_fast64_t nextChunk;
+    uint64_t *chunkHashes;
+    uint32_t *blockCrcs;
+    size_t blockSize;
+};
+
+/* Where a block of a book code container starts, how many bytes of it there are, and the 
+ * CRC-32C of those bytes and of the bytes of the original file it holds the offsets of
+ */
+struct blockIndexEntryStruct {
+    uint64_t bkCdPos;
+    uint64_t bkCdLength;
+    uint32_t bkCdCrc;
+    uint32_t orgFilCrc;
+};
+
+/* The end of a book code container, giving where its block index starts */
+struct blockIndexFooterStruct {
+    uint64_t blockCount;
+    uint64_t indexPos;
+    char magic[4];
+    uint32_t version;
+};
+
+/* Tracks how far into the book file it has to be read before it holds at least need[n] of every 
+ * byte value n. have is signed so that a byte can be left out by starting its count at -1.
+ */
+struct prefixCoverStruct {
+    int64_t need[256];
+    int64_t have[256];
+    int deficit;
+    bool covered;
+    uint64_t end;
+};
+
+/* A thread that reads the next buffer of the book file while mapping goes through the current 
+ * one. Mapping asks for the buffer at requestedPos, and pending is cleared once it is in buffer.
+ */
+struct bookReadAheadStruct {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int bkFilDescriptor;
+    byte_t *buffer;
+    byte_t *bkFilBuffer;
+    size_t bufSize;
+    size_t bytesRead;
+    off_t requestedPos;
+    bool pending;
+    bool quit;
+};
+
+/* Histograms regions of a file in a thread of its own. Region n starts at n * regionStride and is 
+ * regionSize bytes long, or shorter if the file ends first.
+ */
+struct histogramWorkerStruct {
+    pthread_t thread;
+    const char *fileName;
+    size_t fileSize;
+    size_t regionStride;
+    size_t regionSize;
+    int regionCount;
+    size_t skipEvery;
+    uint64_t (*histograms)[256];
+    int *firstBytes;
+};
+
+/* An offset from the book code along with the position of the byte it represents in the 
+ * extracted file buffer, so offsets can be sorted and their bytes put back in order afterwards
+ */
+struct gatherPairStruct {
+    uoffset_t byteOffset;
+    uint32_t extrFilBufPos;
+};
+
 struct bookFileStruct {
     FILE *bkFil;
     char bkFilName[NAME_MAX];
     byte_t bkFilByte;
     size_t bkFilSize;
+    size_t bkFilStart;
     byte_t *bkFilBuffer;
     size_t bkFilBufSize;
     uoffset_t bkFilPos;
     uoffset_t bkFilBufPos;
+    byte_t *bkFilMap;
+    struct bookUringStruct *bkFilUring;
+    struct gatherPairStruct *bkFilGatherPairs;
+    struct gatherPairStruct *bkFilGatherPairsTmp;
+    uint32_t *bkFilPosList;
+    uint64_t *bkFilUsedMap;
+    size_t bkFilUsedMapSize;
+    uint64_t *bkFilUnusedBits;
+    char bkFilIndexName[NAME_MAX];
+    byte_t *bkFilIndexMap;
+    size_t bkFilIndexMapSize;
+    size_t bkFilUnusedLevelStart[UNUSED_BITS_MAX_LEVELS + 1];
+    int bkFilUnusedLevels;
+    size_t bkFilPosListStart[257];
+    size_t bkFilPosListCursor[256];
+    bool bkFilPosListSparse[256];
 };
 
 struct bookCodeStruct {
@@ -83,6 +346,47 @@ struct bookCodeStruct {
     size_t bkCdSize;
     uoffset_t *bkCdBuffer;
     size_t bkCdBufSize;
+    size_t bkCdBufPos;
+    enum bookCodeFormat bkCdFormat;
+    byte_t *bkCdCodedBuffer;
+    size_t bkCdCodedBufSize;
+    size_t bkCdCodedBufPos;
+    size_t bkCdCodedBufLen;
+    uoffset_t bkCdPrevOffset;
+    int bkCdOffsetWidth;
+    size_t bkCdOffsetBytes;
+    void (*packOffsets)(const uoffset_t *offsets, byte_t *packed, size_t count);
+    void (*unpackOffsets)(const byte_t *packed, uoffset_t *offsets, size_t count);
+    enum bookCodeCompression bkCdCompression;
+    lzma_stream bkCdLzma;
+    byte_t *bkCdCompressedBuffer;
+    size_t bkCdCompressedBufSize;
+    byte_t *bkCdShuffleBuffer;
+    uoffset_t *bkCdUnshuffled;
+    size_t bkCdShuffleBufPos;
+    size_t bkCdShuffleBufLen;
+    bool bkCdEnd;
+    uint64_t bkCdReadEnd;
+    int bkCdCompressionLevel;
+    int bkCdCompressionThreads;
+    bool bkCdContainer;
+    bool bkCdBookRecorded;
+    struct bookCodeContainerStruct bkCdContainerHeader;
+    struct blockIndexEntryStruct *bkCdBlocks;
+    size_t bkCdBlockCount;
+    size_t bkCdBlocksAllocated;
+    uint64_t bkCdOffsetCount;
+    uint64_t bkCdOffsetsLeft;
+    uint64_t bkCdBytesWritten;
+    uint32_t *bkCdOrgFilCrcs;
+    uint64_t bkCdCheckPos;
+    uint64_t bkCdCheckBlock;
+    uint32_t bkCdCheckCrc;
+    bool bkCdCheckWhole;
+    uint64_t bkCdOrgCheckPos;
+    uint32_t bkCdOrgCheckCrc;
+    bool bkCdOrgCheckWhole;
+    uint64_t bkCdBlocksChecked;
 };
 
 struct originalFileStruct {
@@ -106,6 +410,123 @@ struct extractedFileStruct {
 struct offsetStruct {
     uoffset_t byteOffset;
     offset_t offsetDigest[256];
+    uoffset_t localityBlockMin;
+    uoffset_t localityBlockMax;
+    size_t localityBlockCount;
+    uint64_t localitySpanTotal;
+    size_t localityBlocks;
+};
+
+/* Shared between extractBytes and its worker threads. Each chunk of the book code is split into 
+ * one slice per worker, and every worker looks up the bytes for its slice and writes them 
+ * straight to their place in the extracted file.
+ */
+#ifdef HAVE_IO_URING
+/* An io_uring set up for reading pages of the book file, with the rings shared with the kernel 
+ * and a page buffer for each read that can be in flight. A slot is a page buffer along with the 
+ * sorted pairs whose bytes are in that page.
+ */
+struct bookUringStruct {
+    int ringFd;
+    unsigned entries;
+    unsigned *sqTail;
+    unsigned *sqMask;
+    unsigned *sqArray;
+    unsigned *cqHead;
+    unsigned *cqTail;
+    unsigned *cqMask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sqRing;
+    size_t sqRingSize;
+    void *cqRing;
+    size_t cqRingSize;
+    size_t sqesSize;
+    byte_t *pages;
+    off_t *pageStart;
+    size_t *pageFirstPair;
+    size_t *pagePairEnd;
+    unsigned *freeSlots;
+    unsigned freeCount;
+    unsigned queued;
+    unsigned inFlight;
+    struct gatherPairStruct *pairs;
+    byte_t *bytes;
+};
+#endif
+
+struct extractPoolStruct {
+    pthread_barrier_t chunkReady;
+    pthread_barrier_t chunkDone;
+    uoffset_t *offsets;
+    byte_t *bytes;
+    size_t count;
+    off_t extrFilPos;
+    int extrFilDescriptor;
+    int workerCount;
+    bool finished;
+    atomic_uint_fast64_t nextBlock;
+    uint64_t blockEnd;
+    uint64_t rangeStart;
+    uint64_t rangeEnd;
+};
+
+/* Workers extracting blocks of a container also get their own copy of the book code state and 
+ * somewhere to put the bytes of a block
+ */
+struct extractWorkerStruct {
+    pthread_t thread;
+    int workerNumber;
+    struct bookFileStruct bkFilSt;
+    struct bookCodeStruct bkCdSt;
+    byte_t *bytes;
+    struct extractPoolStruct *pool;
+    struct optionsStruct *optSt;
+};
+
+/* Each thread mapping in parallel gets its own copy of the state mapOffsets works with, covering 
+ * its own segment of the original file and its own slice of the book file
+ */
+struct mapWorkerStruct {
+    pthread_t thread;
+    struct bookFileStruct bkFilSt;
+    struct bookCodeStruct bkCdSt;
+    struct originalFileStruct orgFilSt;
+    struct offsetStruct oSetSt;
+    struct optionsStruct *optSt;
+};
+
+/* A ring of buffers passed from one thread to another. The producer fills the slot at tail and 
+ * the consumer empties the one at head, each moving on by updating its own index, so neither has 
+ * to take a lock while the ring is neither full nor empty. Only a side that has to wait for the 
+ * other sets its waiting flag and sleeps on cond.
+ */
+struct pipelineRingStruct {
+    void *slots[PIPELINE_SLOTS];
+    size_t lengths[PIPELINE_SLOTS];
+    atomic_size_t head;
+    atomic_size_t tail;
+    atomic_bool producerWaiting;
+    atomic_bool consumerWaiting;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+/* Mapping split into a thread that reads the original file, the mapper, and a thread that 
+ * writes the book code out. The mapper fills buffers of mapperBkCdSt and the writer writes them 
+ * through bkCdSt, which holds everything else about writing the book code.
+ */
+struct mapPipelineStruct {
+    pthread_t readerThread;
+    pthread_t writerThread;
+    struct pipelineRingStruct orgFilRing;
+    struct pipelineRingStruct bkCdRing;
+    struct originalFileStruct *orgFilSt;
+    struct bookCodeStruct *bkCdSt;
+    struct bookCodeStruct mapperBkCdSt;
+    byte_t *orgFilBuffer;
+    uoffset_t *bkCdBuffer;
+    size_t orgFilSlot;
 };
 
 struct optionsStruct {
@@ -120,9 +541,26 @@ struct optionsStruct {
     bool bkFilBufSizeGiven;
     bool extrFilBufSizeGiven;
     bool allowDuplicates;
+    bool uniqueOffsets;
+    bool buildIndex;
+    bool useIndex;
+    bool analyzeBook;
     bool writeToStdout;
     bool readFromStdin;
     bool resetAtEndOfBuf;
+    bool positionLists;
+    bool sortedGather;
+    bool ioUring;
+    bool readAhead;
+    bool pipeline;
+    bool slidingWindow;
+    bool container;
+    bool noVerify;
+    bool rangeGiven;
+    uint64_t rangeStart;
+    uint64_t rangeLength;
+    int threadCount;
+    int compressionLevel;
     int verbosityLevel;  
 };
 
@@ -169,240 +607,3222 @@ int fwriteWErrCheck(void *ptr, size_t size, size_t nmemb, FILE *stream, int *ret
 
 int getBufSizeMultiple(char *value) { 
     
-    #define MAX_DIGITS 13
-    char valString[MAX_DIGITS] = {0};
-    /* Compiling without optimization results in extremely slow speeds, but this will be optimized 
-     * out if not set to volatile.
-     */
-    volatile int valueLength = 0;
-    volatile int multiple = 1;
-    
-    /* value from getsubopt is not null-terminated so must copy and get the length manually without
-     * string functions
-     */
-    for(valueLength = 0;valueLength < MAX_DIGITS;valueLength++) {
-        if(isdigit(value[valueLength])) {
-            valString[valueLength] = value[valueLength];
-            continue;
-        }
-        else if(isalpha(value[valueLength])) {
-            valString[valueLength] = value[valueLength];
-            valueLength++;
-            break;
-        }
-    }
+    /* The suffix, if there is one, is the first character after the digits */
+    while(isdigit(*value))
+        value++;
     
-    if(valString[valueLength-1] == 'b' || valString[valueLength-1] == 'B')
-        multiple = 1;
-    if(valString[valueLength-1] == 'k' || valString[valueLength-1] == 'K')
-        multiple = 1024;
-    if(valString[valueLength-1] == 'm' || valString[valueLength-1] == 'M')
-        multiple = 1024*1024;
+    if(*value == 'k' || *value == 'K')
+        return 1024;
+    if(*value == 'm' || *value == 'M')
+        return 1024*1024;
         
-    return multiple;
+    return 1;
 }
 
-int mapOffsets(
-struct bookFileStruct *bkFilSt,
-struct bookCodeStruct *bkCdSt, 
-struct originalFileStruct *orgFilSt,
-struct offsetStruct *oSetSt,
-struct optionsStruct *optSt
-)
+size_t getFileSize(const char *filename)
 {
-    int returnVal = 0;
-    int repeatsFound = 0;
+    struct stat st;
     
-    /*Prime the bkFilBuffer before starting the loop*/
-    if(freadWErrCheck(bkFilSt->bkFilBuffer, 1, sizeof(byte_t) * bkFilSt->bkFilBufSize, bkFilSt->bkFil, &returnVal) != 0) {
-        PRINT_SYS_ERROR(returnVal);
+    if(stat(filename, &st) == -1) {
+        PRINT_SYS_ERROR(errno);
         exit(EXIT_FAILURE);
     }
+    
+    return st.st_size;
+}
 
-    /* Begin mapping the original file to offsets in the book file */
-    size_t bytesRemaining = orgFilSt->orgFilSize;
-    size_t currentChunk = orgFilSt->orgFilBufSize;
-    for (; bytesRemaining; bytesRemaining -= currentChunk) {
-        if(currentChunk > bytesRemaining) {
-            currentChunk = bytesRemaining;
-        }
+/* Parses one number of a range with its optional b, k or m suffix, leaving end just past it. 
+ * Returns false if it isn't a number or doesn't fit in 64 bits once multiplied out.
+ */
+bool parseRangeValue(char *value, char **end, uint64_t *result)
+{
+    if (!isdigit(value[0])) {
+        return false;
+    }
+    
+    errno = 0;
+    uint64_t number = strtoull(value, end, 10);
+    if (errno == ERANGE) {
+        return false;
+    }
+    
+    uint64_t multiple = getBufSizeMultiple(value);
+    if (number > UINT64_MAX / multiple) {
+        return false;
+    }
+    *result = number * multiple;
+    
+    if (**end == 'b' || **end == 'B' || multiple != 1) {
+        (*end)++;
+    }
+    
+    return true;
+}
 
-        if(freadWErrCheck(orgFilSt->orgFilBuffer, 1, sizeof(byte_t) * currentChunk, orgFilSt->orgFil, &returnVal) !=0 ) {
-            PRINT_SYS_ERROR(returnVal);
-            exit(EXIT_FAILURE);
-        }
-        
-        if(optSt->verbosityLevel >= 2) {
-            fprintf(stderr,"Processing chunk %lu-%lu of original file...\n", ftell(orgFilSt->orgFil) - currentChunk, ftell(orgFilSt->orgFil));
+/* Parses a range to extract given as START:LEN, each of which can be suffixed like a buffer size. 
+ * LEN can be left out to extract to the end of the book code. Returns false if the range can't 
+ * be parsed.
+ */
+bool parseRange(char *value, struct optionsStruct *optSt)
+{
+    char *end;
+    
+    if (!parseRangeValue(value, &end, &optSt->rangeStart) || *end != ':') {
+        return false;
+    }
+    
+    value = end + 1;
+    optSt->rangeLength = UINT64_MAX;
+    if (*value != '\0') {
+        if (!parseRangeValue(value, &end, &optSt->rangeLength) || *end != '\0') {
+            return false;
         }
+    }
+    
+    optSt->rangeGiven = true;
+    
+    return true;
+}
 
-        orgFilSt->orgFilBufPos = 0;
-
-    /* We will need to jump to the head of this loop if a byte is mapped, but because the comparison
-     * is within a nested loop, a break procedure will not work so a goto is needed
-    */
-    getNextOriginalFileByte:
-        while (orgFilSt->orgFilBufPos < currentChunk) {
-
-            orgFilSt->orgFilByte = orgFilSt->orgFilBuffer[orgFilSt->orgFilBufPos];
-
-            while (bkFilSt->bkFilPos < bkFilSt->bkFilSize) {
-
-                for (; bkFilSt->bkFilBufPos < bkFilSt->bkFilBufSize; bkFilSt->bkFilBufPos++) {
-
-                    bkFilSt->bkFilByte = bkFilSt->bkFilBuffer[bkFilSt->bkFilBufPos];
-                    
-                    if (orgFilSt->orgFilByte == bkFilSt->bkFilByte) {
-
-                        oSetSt->byteOffset = bkFilSt->bkFilBufPos + bkFilSt->bkFilPos;
-
-                        if(!optSt->allowDuplicates) {
-                            /* This will check if offset for the book file byte has been previously 
-                             * indexed already in order to prevent repeats.
-                             */
-                            if (oSetSt->offsetDigest[bkFilSt->bkFilByte] == oSetSt->byteOffset) {
-                                
-                                /* If repeatsFound is 2 or over then we cannot avoid a repeat in the 
-                                 * buffer and should refill it below
-                                 */
-                                if(repeatsFound >= 2) {
-                                    goto refillBuffer;
-                                }               
-                                                 
-                                /* Have to be sure to start back at the beginning of the buffer if we 
-                                 * have reached the end
-                                 */
-                                if (bkFilSt->bkFilBufPos == (bkFilSt->bkFilBufSize - 1)) {
-                                    bkFilSt->bkFilBufPos = 0;
-                                }
-                                
-                                repeatsFound++;
-                                continue;
-                            }
-                        }
-                        
-                        repeatsFound = 0;
-
-                        /* This will index the offset for the book file byte found in order to be 
-                         * checked next time around.
-                         */
-                        oSetSt->offsetDigest[bkFilSt->bkFilByte] = oSetSt->byteOffset;
-
-                        if(fwriteWErrCheck(&oSetSt->byteOffset, 1, sizeof(oSetSt->byteOffset), bkCdSt->bkCd, &returnVal) != 0) {
-                            PRINT_SYS_ERROR(returnVal);
-                            exit(EXIT_FAILURE);
-                        }
-                        
-                        if(optSt->verbosityLevel >= 3) {
-                            fprintf(stderr,"Wrote offset %lu\n", (uint64_t)oSetSt->byteOffset);
-                        }
-
-                        orgFilSt->orgFilBufPos++;
+/* Sets up the levels of the unused position bits for a book file buffer of bkFilBufSize bytes */
+void allocUnusedPositions(struct bookFileStruct *bkFilSt)
+{
+    size_t levelBits = bkFilSt->bkFilBufSize;
+    size_t totalWords = 0;
+    
+    bkFilSt->bkFilUnusedLevels = 0;
+    do {
+        size_t levelWords = (levelBits + 63) / 64;
+        bkFilSt->bkFilUnusedLevelStart[bkFilSt->bkFilUnusedLevels++] = totalWords;
+        totalWords += levelWords;
+        levelBits = levelWords;
+    } while (levelBits > 1 && bkFilSt->bkFilUnusedLevels < UNUSED_BITS_MAX_LEVELS);
+    bkFilSt->bkFilUnusedLevelStart[bkFilSt->bkFilUnusedLevels] = totalWords;
+    
+    bkFilSt->bkFilUnusedBits = malloc(totalWords * sizeof(uint64_t));
+    if (bkFilSt->bkFilUnusedBits == NULL) {
+        PRINT_SYS_ERROR(errno);
+        exit(EXIT_FAILURE);
+    }
+}
 
-                        goto getNextOriginalFileByte;
-                    } else if ((orgFilSt->orgFilByte != bkFilSt->bkFilByte) && bkFilSt->bkFilBufPos == (bkFilSt->bkFilBufSize - 1)) {
-                        
-                        refillBuffer:
-                        /* Increment the book file position and reset the buffer position */
-                        bkFilSt->bkFilPos += bkFilSt->bkFilBufSize;
-                        bkFilSt->bkFilBufPos = 0;
-                         
-                        /* If we have reached the end of the book file or reset-at-buffer is set */
-                        if (bkFilSt->bkFilPos >= (bkFilSt->bkFilSize - 1) || optSt->resetAtEndOfBuf) {
-
-                            /* This will check if the file byte was not able to be mapped to any 
-                             * byte in the book file, in which case we we will abort.
-                             */
-                            if (oSetSt->offsetDigest[orgFilSt->orgFilByte] == -1) {
-                                fprintf(stderr,"Not enough entropy in book file or book buffer, book code could not be created\n");
-                                exit(EXIT_FAILURE);
-                            }
-                            
-                            /*Reset to the beginning of the book file to fill the buffer*/
-                            bkFilSt->bkFilPos = 0;
-                            fseek(bkFilSt->bkFil, 0, SEEK_SET);
-                        }
-                        
-                        /* Refill the book file buffer with the next chunk */
-                        if(freadWErrCheck(bkFilSt->bkFilBuffer, 1, sizeof(byte_t) * bkFilSt->bkFilBufSize, bkFilSt->bkFil, &returnVal) != 0) {
-                            PRINT_SYS_ERROR(returnVal);
-                            exit(EXIT_FAILURE);
-                        }
-                    }
-                }
+/* Sets the bit of every entry of bkFilPosList whose offset has not been used yet, and then 
+ * summarizes each level into the one above it
+ */
+void markUnusedPositions(struct bookFileStruct *bkFilSt)
+{
+    uint64_t *unusedBits = bkFilSt->bkFilUnusedBits;
+    
+    memset(unusedBits, 0, bkFilSt->bkFilUnusedLevelStart[bkFilSt->bkFilUnusedLevels] * sizeof(uint64_t));
+    
+    for (size_t i = 0; i < bkFilSt->bkFilBufSize; i++) {
+        uoffset_t offset = bkFilSt->bkFilPos + bkFilSt->bkFilPosList[i];
+        if (!(bkFilSt->bkFilUsedMap[offset >> 6] & ((uint64_t)1 << (offset & 63)))) {
+            unusedBits[i >> 6] |= (uint64_t)1 << (i & 63);
+        }
+    }
+    
+    for (int level = 1; level < bkFilSt->bkFilUnusedLevels; level++) {
+        uint64_t *below = unusedBits + bkFilSt->bkFilUnusedLevelStart[level - 1];
+        uint64_t *above = unusedBits + bkFilSt->bkFilUnusedLevelStart[level];
+        size_t belowWords = bkFilSt->bkFilUnusedLevelStart[level] - bkFilSt->bkFilUnusedLevelStart[level - 1];
+        
+        for (size_t word = 0; word < belowWords; word++) {
+            if (below[word] != 0) {
+                above[word >> 6] |= (uint64_t)1 << (word & 63);
             }
         }
     }
-
-    return 0;
 }
 
-int extractBytes(
-struct bookFileStruct *bkFilSt,
-struct bookCodeStruct *bkCdSt, 
-struct extractedFileStruct *extrFilSt,
-struct offsetStruct *oSetSt,
-struct optionsStruct *optSt
-)
+/* Returns the index of the first entry of bkFilPosList at or after index whose offset has not 
+ * been used, or bkFilBufSize if there is none. It climbs until a level has a set bit at or after 
+ * the word it came from, and then follows the lowest set bits back down, so it looks at no more 
+ * than two words per level however many used entries it skips.
+ */
+size_t findNextUnusedPosition(struct bookFileStruct *bkFilSt, size_t index)
 {
-    int returnVal = 0;
-    
-    size_t currentChunk;
+    uint64_t *unusedBits = bkFilSt->bkFilUnusedBits;
+    int level = 0;
     
     while (1) {
+        if (level == bkFilSt->bkFilUnusedLevels) {
+            return bkFilSt->bkFilBufSize;
+        }
         
-        currentChunk = fread(bkCdSt->bkCdBuffer,sizeof(byte_t),bkCdSt->bkCdBufSize,bkCdSt->bkCd);
-        
-        if(currentChunk < bkCdSt->bkCdBufSize && ferror(bkCdSt->bkCd)) {
-            PRINT_FILE_ERROR(bkCdSt->bkCdFilName,errno);
-            exit(EXIT_FAILURE);
+        size_t word = index >> 6;
+        if (word >= bkFilSt->bkFilUnusedLevelStart[level + 1] - bkFilSt->bkFilUnusedLevelStart[level]) {
+            return bkFilSt->bkFilBufSize;
         }
         
-        if(optSt->verbosityLevel >= 2) {
-            fprintf(stderr,"Processing chunk %lu-%lu of original file...\n", ftell(bkCdSt->bkCd) - currentChunk, ftell(bkCdSt->bkCd));
-        }    
-
-        /* Every uoffset_t sized chunk of the book code represents 1 byte of the original file, so 
-         * we need to divide currentChunk by the size of the byteOffset (which will be equal to 
-         * uoffset_t) to match each offset to a  byte in the extracted file buffer.
-         */
-        for (extrFilSt->extrFilBufPos = 0; extrFilSt->extrFilBufPos < currentChunk / sizeof(oSetSt->byteOffset); extrFilSt->extrFilBufPos++) {
-            
-            /* Use the extracted file buffer position to index the offsets in the book code buffer 
-             * and seek to said offset in the book file.
-             */
-            fseek(bkFilSt->bkFil, bkCdSt->bkCdBuffer[extrFilSt->extrFilBufPos], SEEK_SET);
-            
-            /* Grab the byte residing at that offset in the book file and copy it into the 
-             * extracted file buffer
-             */
-            extrFilSt->extrFilBuffer[extrFilSt->extrFilBufPos] = fgetc(bkFilSt->bkFil);
+        uint64_t bits = unusedBits[bkFilSt->bkFilUnusedLevelStart[level] + word] & (~(uint64_t)0 << (index & 63));
+        if (bits != 0) {
+            index = word * 64 + __builtin_ctzll(bits);
+            break;
         }
         
-        if(optSt->verbosityLevel >= 3) {
-            fprintf(stderr,"Extracted byte at offset %lu", (uint64_t)bkCdSt->bkCdBuffer[extrFilSt->extrFilBufPos]);
-        }    
+        index = word + 1;
+        level++;
+    }
+    
+    while (level > 0) {
+        level--;
+        index = index * 64 + __builtin_ctzll(unusedBits[bkFilSt->bkFilUnusedLevelStart[level] + index]);
+    }
+    
+    return index;
+}
 
-        /* Again, currentChunk needs to be divided by the size of the byteOffset to accurately 
-         * represent how many bytes to write
-         */
-        if(fwriteWErrCheck(extrFilSt->extrFilBuffer, 1, currentChunk / sizeof(oSetSt->byteOffset), extrFilSt->extrFil, &returnVal) != 0) {
-            PRINT_SYS_ERROR(returnVal);
-            exit(EXIT_FAILURE);
-        }
+/* Clears the bit of an entry of bkFilPosList once its offset is used, along with the bit above 
+ * any word that no longer has bits set
+ */
+void clearUnusedPosition(struct bookFileStruct *bkFilSt, size_t index)
+{
+    for (int level = 0; level < bkFilSt->bkFilUnusedLevels; level++) {
+        uint64_t *word = &bkFilSt->bkFilUnusedBits[bkFilSt->bkFilUnusedLevelStart[level] + (index >> 6)];
         
-        if(currentChunk < bkCdSt->bkCdBufSize && feof(bkCdSt->bkCd)) {
+        *word &= ~((uint64_t)1 << (index & 63));
+        if (*word != 0) {
             break;
         }
         
+        index >>= 6;
+    }
+}
+
+size_t bookIndexRecordSize(size_t bkFilBufSize)
+{
+    return BOOK_INDEX_RECORD_HEADER_SIZE + bkFilBufSize * sizeof(uint32_t);
+}
+
+/* Points the position list at the record for the buffer just loaded in the book index, instead 
+ * of sorting the buffer. The buffer is hashed first to make sure the book file hasn't changed 
+ * since the index was built.
+ */
+void loadBookBufferIndex(struct bookFileStruct *bkFilSt)
+{
+    struct bookIndexHeaderStruct header;
+    uint64_t bufferStart = bkFilSt->bkFilStart + bkFilSt->bkFilPos;
+    uint64_t recordStart, bufferHash;
+    uint32_t listStarts[257];
+    byte_t *record = NULL;
+    
+    /* There are only as many records as threads, so they are just looked through */
+    memcpy(&header, bkFilSt->bkFilIndexMap, sizeof(header));
+    for (uint64_t i = 0; i < header.bufferCount && record == NULL; i++) {
+        byte_t *candidate = bkFilSt->bkFilIndexMap + sizeof(header) + i * bookIndexRecordSize(bkFilSt->bkFilBufSize);
+        memcpy(&recordStart, candidate, sizeof(recordStart));
+        if (recordStart == bufferStart) {
+            record = candidate;
+        }
     }
     
-    return 0;
+    if (record == NULL) {
+        fprintf(stderr,"Index %s has no position lists for the buffer at byte %lu of the book file, it was built for mapping with -t %lu\n", bkFilSt->bkFilIndexName, (uint64_t)bufferStart, (uint64_t)header.threadCount);
+        exit(EXIT_FAILURE);
+    }
+    
+    memcpy(&bufferHash, record + sizeof(recordStart), sizeof(bufferHash));
+    if (lzma_crc64(bkFilSt->bkFilBuffer, bkFilSt->bkFilBufSize, 0) != bufferHash) {
+        fprintf(stderr,"Book file does not match index %s at bytes %lu-%lu, rebuild it with --build-index\n", bkFilSt->bkFilIndexName, (uint64_t)bufferStart, (uint64_t)(bufferStart + bkFilSt->bkFilBufSize));
+        exit(EXIT_FAILURE);
+    }
+    
+    memcpy(listStarts, record + sizeof(recordStart) + sizeof(bufferHash), sizeof(listStarts));
+    for (int i = 0; i < 257; i++) {
+        bkFilSt->bkFilPosListStart[i] = listStarts[i];
+    }
+    
+    bkFilSt->bkFilPosList = (uint32_t *)(record + BOOK_INDEX_RECORD_HEADER_SIZE);
 }
 
-void printHelp(char *argv) {
+/* Sorts every position of bkFilBuffer into a list per byte value with a counting sort, so that
+ * bkFilPosList[bkFilPosListStart[n]] to bkFilPosList[bkFilPosListStart[n+1] - 1] holds the 
+ * positions of byte value n in ascending order
+ */
+void indexBookBuffer(struct bookFileStruct *bkFilSt)
+{
+    if (bkFilSt->bkFilIndexMap != NULL) {
+        loadBookBufferIndex(bkFilSt);
+    } else {
+        size_t byteCounts[256] = {0};
+        
+        for (size_t i = 0; i < bkFilSt->bkFilBufSize; i++) {
+            byteCounts[bkFilSt->bkFilBuffer[i]]++;
+        }
+        
+        bkFilSt->bkFilPosListStart[0] = 0;
+        for (int i = 0; i < 256; i++) {
+            bkFilSt->bkFilPosListStart[i + 1] = bkFilSt->bkFilPosListStart[i] + byteCounts[i];
+            bkFilSt->bkFilPosListCursor[i] = bkFilSt->bkFilPosListStart[i];
+        }
+        
+        for (size_t i = 0; i < bkFilSt->bkFilBufSize; i++) {
+            bkFilSt->bkFilPosList[bkFilSt->bkFilPosListCursor[bkFilSt->bkFilBuffer[i]]++] = i;
+        }
+    }
+    
+    for (int i = 0; i < 256; i++) {
+        bkFilSt->bkFilPosListCursor[i] = bkFilSt->bkFilPosListStart[i];
+        bkFilSt->bkFilPosListSparse[i] = (bkFilSt->bkFilPosListStart[i + 1] - bkFilSt->bkFilPosListStart[i]) * POSITION_LIST_MIN_GAP <= bkFilSt->bkFilBufSize;
+    }
+    
+    if (bkFilSt->bkFilUnusedBits != NULL) {
+        markUnusedPositions(bkFilSt);
+    }
+}
+
+/* Returns the first entry of the position list of orgFilByte whose position is at or after 
+ * bkFilBufPos, or the end of the list if there is none, and leaves the cursor of the list on it
+ */
+size_t seekPositionList(struct bookFileStruct *bkFilSt, byte_t orgFilByte)
+{
+    size_t cursor = bkFilSt->bkFilPosListCursor[orgFilByte];
+    size_t listStart = bkFilSt->bkFilPosListStart[orgFilByte];
+    size_t listEnd = bkFilSt->bkFilPosListStart[orgFilByte + 1];
+    
+    /* The buffer position only moves backwards when it wraps around to the beginning of the 
+     * buffer, so the cursor only needs to be rewound then
+     */
+    if (cursor > listStart && bkFilSt->bkFilPosList[cursor - 1] >= bkFilSt->bkFilBufPos) {
+        cursor = listStart;
+    }
+    
+    /* Guess where the entry is from how far the buffer position has moved past the cursor and 
+     * how densely the byte value fills the buffer, gallop out from the guess until the entry is 
+     * bracketed and then binary search what is left. Only the few entries around the guess are 
+     * looked at, instead of everything the cursor fell behind on.
+     */
+    if (cursor < listEnd && bkFilSt->bkFilPosList[cursor] < bkFilSt->bkFilBufPos) {
+        size_t low = cursor, high = listEnd, step = 1;
+        size_t guess = cursor + 1 + (uint64_t)(bkFilSt->bkFilBufPos - bkFilSt->bkFilPosList[cursor]) * (listEnd - listStart) / bkFilSt->bkFilBufSize;
+        if (guess > listEnd - 1) {
+            guess = listEnd - 1;
+        }
+        
+        if (bkFilSt->bkFilPosList[guess] >= bkFilSt->bkFilBufPos) {
+            high = guess;
+            while (high - low > step && bkFilSt->bkFilPosList[high - step] >= bkFilSt->bkFilBufPos) {
+                high -= step;
+                step *= 2;
+            }
+            if (high - low > step) {
+                low = high - step;
+            }
+        } else {
+            low = guess;
+            while (listEnd - low > step && bkFilSt->bkFilPosList[low + step] < bkFilSt->bkFilBufPos) {
+                low += step;
+                step *= 2;
+            }
+            if (listEnd - low > step) {
+                high = low + step;
+            }
+        }
+        
+        /* Invariant: bkFilPosList[low] < bkFilBufPos and bkFilPosList[high] >= bkFilBufPos 
+         * or high is listEnd
+         */
+        while (high - low > 1) {
+            size_t middle = low + (high - low) / 2;
+            if (bkFilSt->bkFilPosList[middle] < bkFilSt->bkFilBufPos) {
+                low = middle;
+            } else {
+                high = middle;
+            }
+        }
+        cursor = high;
+    }
+    
+    bkFilSt->bkFilPosListCursor[orgFilByte] = cursor;
+    
+    return cursor;
+}
+
+/* Returns the position of the first byte in bkFilBuffer at or after bkFilBufPos that matches 
+ * orgFilByte, or bkFilBufSize if no byte left in the buffer matches it
+ */
+uoffset_t findNextBookByte(struct bookFileStruct *bkFilSt, byte_t orgFilByte, struct optionsStruct *optSt)
+{
+    /* With unique offsets, the first entry of the position list at or after the buffer position 
+     * is found as usual, and the unused position bits lead from there straight to the first entry 
+     * that has not been used, however many used ones come between them
+     */
+    if(bkFilSt->bkFilUnusedBits != NULL) {
+        size_t cursor = findNextUnusedPosition(bkFilSt, seekPositionList(bkFilSt, orgFilByte));
+        if (cursor >= bkFilSt->bkFilPosListStart[orgFilByte + 1]) {
+            return bkFilSt->bkFilBufSize;
+        }
+        
+        bkFilSt->bkFilPosListCursor[orgFilByte] = cursor;
+        
+        return bkFilSt->bkFilPosList[cursor];
+    }
+    
+    /* Byte values that are common in the buffer are scanned for below instead */
+    if(optSt->positionLists && bkFilSt->bkFilPosListSparse[orgFilByte]) {
+        size_t cursor = seekPositionList(bkFilSt, orgFilByte);
+        
+        return cursor < bkFilSt->bkFilPosListStart[orgFilByte + 1] ? bkFilSt->bkFilPosList[cursor] : bkFilSt->bkFilBufSize;
+    }
+    
+    if (bkFilSt->bkFilBufPos >= bkFilSt->bkFilBufSize) {
+        return bkFilSt->bkFilBufSize;
+    }
+    
+    /* memchr compares many bytes at a time with whatever vector instructions the CPU supports, 
+     * picked by the C library at runtime, instead of comparing one byte per iteration
+     */
+    byte_t *bkFilBytePtr = memchr(bkFilSt->bkFilBuffer + bkFilSt->bkFilBufPos, orgFilByte, bkFilSt->bkFilBufSize - bkFilSt->bkFilBufPos);
+    
+    return bkFilBytePtr != NULL ? (uoffset_t)(bkFilBytePtr - bkFilSt->bkFilBuffer) : bkFilSt->bkFilBufSize;
+}
+
+/* Returns the name of a book code format as given with --format, or NULL if there is none */
+const char *bookCodeFormatName(enum bookCodeFormat bkCdFormat)
+{
+    switch (bkCdFormat) {
+    case BOOK_CODE_RAW:
+        return "raw";
+    case BOOK_CODE_VARINT:
+        return "varint";
+    }
+    
+    return NULL;
+}
+
+/* Packs offsets into the little-endian integers of the given width that raw book codes hold, and 
+ * unpacks them again. There is one pair of functions per width so that the size of each offset is 
+ * fixed, and on little-endian machines each one is a single copy of its low bytes.
+ */
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define DEFINE_OFFSET_PACKING(width) \
+void packOffsets##width(const uoffset_t *offsets, byte_t *packed, size_t count) \
+{ \
+    for (size_t i = 0; i < count; i++) { \
+        memcpy(packed + i * (width / CHAR_BIT), &offsets[i], width / CHAR_BIT); \
+    } \
+} \
+\
+void unpackOffsets##width(const byte_t *packed, uoffset_t *offsets, size_t count) \
+{ \
+    for (size_t i = 0; i < count; i++) { \
+        uoffset_t byteOffset = 0; \
+        memcpy(&byteOffset, packed + i * (width / CHAR_BIT), width / CHAR_BIT); \
+        offsets[i] = byteOffset; \
+    } \
+}
+#else
+#define DEFINE_OFFSET_PACKING(width) \
+void packOffsets##width(const uoffset_t *offsets, byte_t *packed, size_t count) \
+{ \
+    for (size_t i = 0; i < count; i++) { \
+        for (int b = 0; b < width / CHAR_BIT; b++) { \
+            packed[i * (width / CHAR_BIT) + b] = offsets[i] >> (b * CHAR_BIT); \
+        } \
+    } \
+} \
+\
+void unpackOffsets##width(const byte_t *packed, uoffset_t *offsets, size_t count) \
+{ \
+    for (size_t i = 0; i < count; i++) { \
+        uoffset_t byteOffset = 0; \
+        for (int b = 0; b < width / CHAR_BIT; b++) { \
+            byteOffset |= (uoffset_t)packed[i * (width / CHAR_BIT) + b] << (b * CHAR_BIT); \
+        } \
+        offsets[i] = byteOffset; \
+    } \
+}
+#endif
+
+DEFINE_OFFSET_PACKING(32)
+DEFINE_OFFSET_PACKING(40)
+DEFINE_OFFSET_PACKING(48)
+DEFINE_OFFSET_PACKING(64)
+
+/* Table for working out CRC-32C a byte at a time where there is no instruction for it */
+uint32_t crc32cTable[256];
+
+uint32_t crc32cByTable(uint32_t crc, const byte_t *bytes, size_t count)
+{
+    crc = ~crc;
+    for (size_t i = 0; i < count; i++) {
+        crc = crc32cTable[(crc ^ bytes[i]) & 0xFF] ^ (crc >> 8);
+    }
+    
+    return ~crc;
+}
+
+#ifdef HAVE_CRC32C_SSE42
+__attribute__((target("sse4.2")))
+uint32_t crc32cBySse42(uint32_t crc, const byte_t *bytes, size_t count)
+{
+    uint64_t crc64 = ~crc;
+    size_t i = 0;
+    
+    for (; i + sizeof(uint64_t) <= count; i += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, bytes + i, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
+    }
+    
+    uint32_t crc32 = crc64;
+    for (; i < count; i++) {
+        crc32 = _mm_crc32_u8(crc32, bytes[i]);
+    }
+    
+    return ~crc32;
+}
+#endif
+
+#ifdef HAVE_CRC32C_ARM
+uint32_t crc32cByArm(uint32_t crc, const byte_t *bytes, size_t count)
+{
+    uint32_t crc32 = ~crc;
+    size_t i = 0;
+    
+    for (; i + sizeof(uint64_t) <= count; i += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, bytes + i, sizeof(word));
+        crc32 = __crc32cd(crc32, word);
+    }
+    for (; i < count; i++) {
+        crc32 = __crc32cb(crc32, bytes[i]);
+    }
+    
+    return ~crc32;
+}
+#endif
+
+/* Works out the CRC-32C of count more bytes carrying on from crc, which is 0 to start with. It is 
+ * pointed at the fastest way the processor has by initCrc32c.
+ */
+uint32_t (*crc32c)(uint32_t crc, const byte_t *bytes, size_t count) = crc32cByTable;
+
+void initCrc32c(void)
+{
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < CHAR_BIT; bit++) {
+            crc = crc & 1 ? (crc >> 1) ^ 0x82F63B78 : crc >> 1;
+        }
+        crc32cTable[i] = crc;
+    }
+    
+#if defined(HAVE_CRC32C_SSE42)
+    if (__builtin_cpu_supports("sse4.2")) {
+        crc32c = crc32cBySse42;
+    }
+#elif defined(HAVE_CRC32C_ARM)
+    crc32c = crc32cByArm;
+#endif
+}
+
+/* Picks the packing functions for an offset width in bits. Returns false if the width is not 
+ * one that is supported.
+ */
+bool setOffsetWidth(struct bookCodeStruct *bkCdSt, int offsetWidth)
+{
+    switch (offsetWidth) {
+    case 32:
+        bkCdSt->packOffsets = packOffsets32;
+        bkCdSt->unpackOffsets = unpackOffsets32;
+    break;
+    case 40:
+        bkCdSt->packOffsets = packOffsets40;
+        bkCdSt->unpackOffsets = unpackOffsets40;
+    break;
+    case 48:
+        bkCdSt->packOffsets = packOffsets48;
+        bkCdSt->unpackOffsets = unpackOffsets48;
+    break;
+    case 64:
+        bkCdSt->packOffsets = packOffsets64;
+        bkCdSt->unpackOffsets = unpackOffsets64;
+    break;
+    default:
+        return false;
+    }
+    
+    bkCdSt->bkCdOffsetWidth = offsetWidth;
+    bkCdSt->bkCdOffsetBytes = offsetWidth / CHAR_BIT;
+    
+    return true;
+}
+
+void writeBookCodeHeader(struct bookCodeStruct *bkCdSt)
+{
+    int returnVal = 0;
+    byte_t header[BOOK_CODE_HEADER_SIZE] = {0};
+    
+    memcpy(header, BOOK_CODE_MAGIC, 4);
+    header[4] = bkCdSt->bkCdContainer ? BOOK_CODE_CONTAINER_VERSION : BOOK_CODE_BOOK_VERSION;
+    header[5] = bkCdSt->bkCdFormat;
+    header[6] = bkCdSt->bkCdCompression;
+    header[7] = bkCdSt->bkCdOffsetWidth;
+    
+    if(fwriteWErrCheck(header, 1, sizeof(header), bkCdSt->bkCd, &returnVal) != 0) {
+        PRINT_SYS_ERROR(returnVal);
+        exit(EXIT_FAILURE);
+    }
+    
+    bkCdSt->bkCdBytesWritten += sizeof(header);
+    
+    if(bkCdSt->bkCdContainer) {
+        if(fwriteWErrCheck(&bkCdSt->bkCdContainerHeader, sizeof(bkCdSt->bkCdContainerHeader), 1, bkCdSt->bkCd, &returnVal) != 0) {
+            PRINT_SYS_ERROR(returnVal);
+            exit(EXIT_FAILURE);
+        }
+        
+        bkCdSt->bkCdBytesWritten += sizeof(bkCdSt->bkCdContainerHeader);
+    } else {
+        struct bookCodeBookStruct book = {bkCdSt->bkCdContainerHeader.bkFilSize, bkCdSt->bkCdContainerHeader.bkFilHash};
+        
+        if(fwriteWErrCheck(&book, sizeof(book), 1, bkCdSt->bkCd, &returnVal) != 0) {
+            PRINT_SYS_ERROR(returnVal);
+            exit(EXIT_FAILURE);
+        }
+        
+        bkCdSt->bkCdBytesWritten += sizeof(book);
+    }
+}
+
+/* Reads the header of the book code to find out what format it is in. Book codes in the raw 
+ * format have no header, so if the first bytes are not the magic bytes they are kept in the coded 
+ * buffer to be used as the first offset. The coded buffer must have been allocated already.
+ */
+void readBookCodeHeader(struct bookCodeStruct *bkCdSt)
+{
+    bkCdSt->bkCdFormat = BOOK_CODE_RAW;
+    setOffsetWidth(bkCdSt, DEFAULT_OFFSET_WIDTH);
+    bkCdSt->bkCdCodedBufPos = 0;
+    bkCdSt->bkCdCodedBufLen = fread(bkCdSt->bkCdCodedBuffer, 1, 4, bkCdSt->bkCd);
+    
+    if (ferror(bkCdSt->bkCd)) {
+        PRINT_FILE_ERROR(bkCdSt->bkCdFilName,errno);
+        exit(EXIT_FAILURE);
+    }
+    
+    if (bkCdSt->bkCdCodedBufLen < 4 || memcmp(bkCdSt->bkCdCodedBuffer, BOOK_CODE_MAGIC, 4) != 0) {
+        return;
+    }
+    
+    byte_t header[BOOK_CODE_HEADER_SIZE - 4];
+    if (fread(header, 1, sizeof(header), bkCdSt->bkCd) != sizeof(header)) {
+        fprintf(stderr,"Book code header is truncated\n");
+        exit(EXIT_FAILURE);
+    }
+    
+    if (header[0] != BOOK_CODE_VERSION && header[0] != BOOK_CODE_CONTAINER_VERSION && header[0] != BOOK_CODE_BOOK_VERSION) {
+        fprintf(stderr,"Book code header version %i is not supported\n", header[0]);
+        exit(EXIT_FAILURE);
+    }
+    
+    if (bookCodeFormatName(header[1]) == NULL) {
+        fprintf(stderr,"Book code format %i is not supported\n", header[1]);
+        exit(EXIT_FAILURE);
+    }
+    
+    if (header[2] != BOOK_CODE_UNCOMPRESSED && header[2] != BOOK_CODE_XZ) {
+        fprintf(stderr,"Book code compression %i is not supported\n", header[2]);
+        exit(EXIT_FAILURE);
+    }
+    
+    /* Headers written before the offset width could be chosen have 0 there */
+    if (!setOffsetWidth(bkCdSt, header[3] == 0 ? DEFAULT_OFFSET_WIDTH : header[3])) {
+        fprintf(stderr,"Book code offset width %i is not supported\n", header[3]);
+        exit(EXIT_FAILURE);
+    }
+    
+    bkCdSt->bkCdFormat = header[1];
+    bkCdSt->bkCdCompression = header[2];
+    bkCdSt->bkCdCodedBufLen = 0;
+    
+    if (header[0] == BOOK_CODE_CONTAINER_VERSION) {
+        if (fread(&bkCdSt->bkCdContainerHeader, sizeof(bkCdSt->bkCdContainerHeader), 1, bkCdSt->bkCd) != 1) {
+            fprintf(stderr,"Book code header is truncated\n");
+            exit(EXIT_FAILURE);
+        }
+        
+        if (bkCdSt->bkCdContainerHeader.blockOffsets == 0 || bkCdSt->bkCdContainerHeader.blockOffsets % SHUFFLE_BLOCK_OFFSETS != 0) {
+            fprintf(stderr,"Book code blocks of %lu offsets are not supported\n", (uint64_t)bkCdSt->bkCdContainerHeader.blockOffsets);
+            exit(EXIT_FAILURE);
+        }
+        
+        bkCdSt->bkCdContainer = true;
+        bkCdSt->bkCdBookRecorded = true;
+        bkCdSt->bkCdOffsetCount = 0;
+        bkCdSt->bkCdOffsetsLeft = bkCdSt->bkCdContainerHeader.orgFilSize;
+    } else if (header[0] == BOOK_CODE_BOOK_VERSION) {
+        struct bookCodeBookStruct book;
+        if (fread(&book, sizeof(book), 1, bkCdSt->bkCd) != 1) {
+            fprintf(stderr,"Book code header is truncated\n");
+            exit(EXIT_FAILURE);
+        }
+        
+        bkCdSt->bkCdContainerHeader.bkFilSize = book.bkFilSize;
+        bkCdSt->bkCdContainerHeader.bkFilHash = book.bkFilHash;
+        bkCdSt->bkCdBookRecorded = true;
+    }
+}
+
+/* Starts a new xz stream, reusing the encoder or decoder that is already set up if there is one. 
+ * The xz encoder splits its input into blocks that are compressed by bkCdCompressionThreads 
+ * threads at once. Any input the decoder has not used yet is kept for the new stream.
+ */
+void startBookCodeStream(struct bookCodeStruct *bkCdSt, bool decompress)
+{
+    lzma_ret lzmaRet;
+    
+    if (decompress) {
+        lzmaRet = lzma_stream_decoder(&bkCdSt->bkCdLzma, UINT64_MAX, 0);
+    } else {
+        lzma_mt mtOptions = {0};
+        mtOptions.threads = bkCdSt->bkCdCompressionThreads;
+        mtOptions.preset = bkCdSt->bkCdCompressionLevel;
+        mtOptions.check = LZMA_CHECK_CRC32;
+        lzmaRet = lzma_stream_encoder_mt(&bkCdSt->bkCdLzma, &mtOptions);
+    }
+    
+    if (lzmaRet != LZMA_OK) {
+        fprintf(stderr,"Could not set up xz %s (error %i)\n", decompress ? "decompression" : "compression", lzmaRet);
+        exit(EXIT_FAILURE);
+    }
+    
+    bkCdSt->bkCdEnd = false;
+}
+
+/* Sets up the buffers and xz stream for compressing the book code while mapping, or 
+ * decompressing it while extracting
+ */
+void startBookCodeCompression(struct bookCodeStruct *bkCdSt, int compressionLevel, int threadCount, bool decompress)
+{
+    lzma_stream lzmaInit = LZMA_STREAM_INIT;
+    
+    bkCdSt->bkCdLzma = lzmaInit;
+    bkCdSt->bkCdCompressionLevel = compressionLevel;
+    bkCdSt->bkCdCompressionThreads = threadCount;
+    bkCdSt->bkCdShuffleBufPos = 0;
+    bkCdSt->bkCdShuffleBufLen = 0;
+    bkCdSt->bkCdCompressedBufSize = DEFAULT_BUFFER_SIZE;
+    bkCdSt->bkCdCompressedBuffer = malloc(bkCdSt->bkCdCompressedBufSize);
+    bkCdSt->bkCdShuffleBuffer = malloc(SHUFFLE_BLOCK_OFFSETS * bkCdSt->bkCdOffsetBytes);
+    bkCdSt->bkCdUnshuffled = malloc(SHUFFLE_BLOCK_OFFSETS * sizeof(uoffset_t));
+    if (bkCdSt->bkCdCompressedBuffer == NULL || bkCdSt->bkCdShuffleBuffer == NULL || bkCdSt->bkCdUnshuffled == NULL) {
+        PRINT_SYS_ERROR(errno);
+        exit(EXIT_FAILURE);
+    }
+    
+    startBookCodeStream(bkCdSt, decompress);
+}
+
+/* Adds bytes just written to a container to the CRC-32C of the block being written */
+void addToBlockCrc(struct bookCodeStruct *bkCdSt, const byte_t *bytes, size_t count)
+{
+    if (bkCdSt->bkCdContainer && bkCdSt->bkCdBlockCount > 0) {
+        struct blockIndexEntryStruct *block = &bkCdSt->bkCdBlocks[bkCdSt->bkCdBlockCount - 1];
+        block->bkCdCrc = crc32c(block->bkCdCrc, bytes, count);
+    }
+}
+
+/* Checks bytes just read from a container against the CRC-32C of each block in its block index, 
+ * as they are read. Where they were read from is kept track of so that a block is only checked if 
+ * it was read from its start, since a range can start partway through one.
+ */
+void checkBookCodeBytes(struct bookCodeStruct *bkCdSt, const byte_t *bytes, size_t count)
+{
+    if (bkCdSt->bkCdBlocks == NULL || count == 0) {
+        return;
+    }
+    
+    uint64_t pos = ftello(bkCdSt->bkCd) - count;
+    
+    /* After a seek, find the block being read with a binary search of the block index */
+    if (pos != bkCdSt->bkCdCheckPos) {
+        uint64_t low = 0, high = bkCdSt->bkCdBlockCount;
+        while (high - low > 1) {
+            uint64_t middle = low + (high - low) / 2;
+            if (bkCdSt->bkCdBlocks[middle].bkCdPos <= pos) {
+                low = middle;
+            } else {
+                high = middle;
+            }
+        }
+        
+        bkCdSt->bkCdCheckBlock = low;
+        bkCdSt->bkCdCheckCrc = 0;
+        bkCdSt->bkCdCheckWhole = pos <= bkCdSt->bkCdBlocks[low].bkCdPos;
+    }
+    bkCdSt->bkCdCheckPos = pos + count;
+    
+    while (count > 0 && bkCdSt->bkCdCheckBlock < bkCdSt->bkCdBlockCount) {
+        struct blockIndexEntryStruct *block = &bkCdSt->bkCdBlocks[bkCdSt->bkCdCheckBlock];
+        
+        /* The header comes before the first block */
+        if (pos < block->bkCdPos) {
+            size_t skipped = block->bkCdPos - pos < count ? block->bkCdPos - pos : count;
+            bytes += skipped;
+            pos += skipped;
+            count -= skipped;
+            continue;
+        }
+        
+        uint64_t blockEnd = block->bkCdPos + block->bkCdLength;
+        size_t piece = blockEnd - pos < count ? blockEnd - pos : count;
+        if (bkCdSt->bkCdCheckWhole) {
+            bkCdSt->bkCdCheckCrc = crc32c(bkCdSt->bkCdCheckCrc, bytes, piece);
+        }
+        bytes += piece;
+        pos += piece;
+        count -= piece;
+        
+        if (pos == blockEnd) {
+            if (bkCdSt->bkCdCheckWhole && bkCdSt->bkCdCheckCrc != block->bkCdCrc) {
+                fprintf(stderr,"Block %lu of %s doesn't match its checksum, so the book code is damaged\n", (uint64_t)bkCdSt->bkCdCheckBlock, bkCdSt->bkCdFilName);
+                exit(EXIT_FAILURE);
+            }
+            
+            bkCdSt->bkCdCheckBlock++;
+            bkCdSt->bkCdCheckCrc = 0;
+            bkCdSt->bkCdCheckWhole = true;
+        }
+    }
+}
+
+/* Writes bytes to the book code, through the xz encoder if it is being compressed */
+void writeBookCodeBytes(struct bookCodeStruct *bkCdSt, byte_t *bytes, size_t count, lzma_action lzmaAction)
+{
+    int returnVal = 0;
+    
+    if (bkCdSt->bkCdCompression == BOOK_CODE_UNCOMPRESSED) {
+        if(fwriteWErrCheck(bytes, 1, count, bkCdSt->bkCd, &returnVal) != 0) {
+            PRINT_SYS_ERROR(returnVal);
+            exit(EXIT_FAILURE);
+        }
+        addToBlockCrc(bkCdSt, bytes, count);
+        bkCdSt->bkCdBytesWritten += count;
+        return;
+    }
+    
+    bkCdSt->bkCdLzma.next_in = bytes;
+    bkCdSt->bkCdLzma.avail_in = count;
+    
+    /* Keep going until all input is taken in, or when finishing, until the encoder says it's done */
+    while (1) {
+        bkCdSt->bkCdLzma.next_out = bkCdSt->bkCdCompressedBuffer;
+        bkCdSt->bkCdLzma.avail_out = bkCdSt->bkCdCompressedBufSize;
+        
+        lzma_ret lzmaRet = lzma_code(&bkCdSt->bkCdLzma, lzmaAction);
+        if (lzmaRet != LZMA_OK && lzmaRet != LZMA_STREAM_END) {
+            fprintf(stderr,"Could not compress book code (error %i)\n", lzmaRet);
+            exit(EXIT_FAILURE);
+        }
+        
+        if(fwriteWErrCheck(bkCdSt->bkCdCompressedBuffer, 1, bkCdSt->bkCdCompressedBufSize - bkCdSt->bkCdLzma.avail_out, bkCdSt->bkCd, &returnVal) != 0) {
+            PRINT_SYS_ERROR(returnVal);
+            exit(EXIT_FAILURE);
+        }
+        addToBlockCrc(bkCdSt, bkCdSt->bkCdCompressedBuffer, bkCdSt->bkCdCompressedBufSize - bkCdSt->bkCdLzma.avail_out);
+        bkCdSt->bkCdBytesWritten += bkCdSt->bkCdCompressedBufSize - bkCdSt->bkCdLzma.avail_out;
+        
+        if (lzmaAction == LZMA_FINISH ? lzmaRet == LZMA_STREAM_END : bkCdSt->bkCdLzma.avail_in == 0) {
+            break;
+        }
+    }
+}
+
+/* Reads up to count bytes of the book code as it is stored, stopping at bkCdReadEnd if a range 
+ * has set one, and checks them against the block index of a container
+ */
+size_t readBookCodeInput(struct bookCodeStruct *bkCdSt, byte_t *bytes, size_t count)
+{
+    if (bkCdSt->bkCdReadEnd != UINT64_MAX) {
+        uint64_t pos = ftello(bkCdSt->bkCd);
+        uint64_t left = pos < bkCdSt->bkCdReadEnd ? bkCdSt->bkCdReadEnd - pos : 0;
+        if (count > left) {
+            count = left;
+        }
+    }
+    
+    size_t bytesRead = fread(bytes, 1, count, bkCdSt->bkCd);
+    
+    if (ferror(bkCdSt->bkCd)) {
+        PRINT_FILE_ERROR(bkCdSt->bkCdFilName,errno);
+        exit(EXIT_FAILURE);
+    }
+    checkBookCodeBytes(bkCdSt, bytes, bytesRead);
+    
+    return bytesRead;
+}
+
+/* Whether there is nothing more of the book code to read, at its end or at bkCdReadEnd */
+bool bookCodeInputEnded(struct bookCodeStruct *bkCdSt)
+{
+    return feof(bkCdSt->bkCd) || (bkCdSt->bkCdReadEnd != UINT64_MAX && (uint64_t)ftello(bkCdSt->bkCd) >= bkCdSt->bkCdReadEnd);
+}
+
+/* Looks for another xz stream straight after the one that just ended, and starts decoding it if 
+ * there is one. Each block of a container is its own stream, while anything else after a stream, 
+ * such as the block index of a container, is not part of the compressed book code.
+ */
+bool nextBookCodeStream(struct bookCodeStruct *bkCdSt)
+{
+    static const byte_t xzMagic[6] = {0xFD, '7', 'z', 'X', 'Z', 0x00};
+    
+    if (bkCdSt->bkCdLzma.avail_in < sizeof(xzMagic) && !bookCodeInputEnded(bkCdSt)) {
+        size_t kept = bkCdSt->bkCdLzma.avail_in;
+        memmove(bkCdSt->bkCdCompressedBuffer, bkCdSt->bkCdLzma.next_in, kept);
+        bkCdSt->bkCdLzma.next_in = bkCdSt->bkCdCompressedBuffer;
+        bkCdSt->bkCdLzma.avail_in += readBookCodeInput(bkCdSt, bkCdSt->bkCdCompressedBuffer + kept, bkCdSt->bkCdCompressedBufSize - kept);
+    }
+    
+    if (bkCdSt->bkCdLzma.avail_in < sizeof(xzMagic) || memcmp(bkCdSt->bkCdLzma.next_in, xzMagic, sizeof(xzMagic)) != 0) {
+        return false;
+    }
+    
+    startBookCodeStream(bkCdSt, true);
+    
+    return true;
+}
+
+/* Reads up to count bytes of the book code into bytes, decompressing them if the book code is 
+ * compressed. Returns how many were read, which is only less than count at the end of the book 
+ * code.
+ */
+size_t readBookCodeBytes(struct bookCodeStruct *bkCdSt, byte_t *bytes, size_t count)
+{
+    if (bkCdSt->bkCdCompression == BOOK_CODE_UNCOMPRESSED) {
+        size_t bytesRead = readBookCodeInput(bkCdSt, bytes, count);
+        
+        if (bytesRead < count) {
+            bkCdSt->bkCdEnd = true;
+        }
+        
+        return bytesRead;
+    }
+    
+    bkCdSt->bkCdLzma.next_out = bytes;
+    bkCdSt->bkCdLzma.avail_out = count;
+    
+    while (bkCdSt->bkCdLzma.avail_out > 0 && !bkCdSt->bkCdEnd) {
+        if (bkCdSt->bkCdLzma.avail_in == 0 && !bookCodeInputEnded(bkCdSt)) {
+            bkCdSt->bkCdLzma.next_in = bkCdSt->bkCdCompressedBuffer;
+            bkCdSt->bkCdLzma.avail_in = readBookCodeInput(bkCdSt, bkCdSt->bkCdCompressedBuffer, bkCdSt->bkCdCompressedBufSize);
+        }
+        
+        lzma_ret lzmaRet = lzma_code(&bkCdSt->bkCdLzma, bookCodeInputEnded(bkCdSt) ? LZMA_FINISH : LZMA_RUN);
+        if (lzmaRet == LZMA_STREAM_END) {
+            bkCdSt->bkCdEnd = !nextBookCodeStream(bkCdSt);
+        } else if (lzmaRet != LZMA_OK) {
+            fprintf(stderr,"Could not decompress book code, it may be truncated or damaged (error %i)\n", lzmaRet);
+            exit(EXIT_FAILURE);
+        }
+    }
+    
+    return count - bkCdSt->bkCdLzma.avail_out;
+}
+
+/* Writes out the shuffled block being built. A full block is written as it is, while a short 
+ * final block has each byte plane written on its own so the planes are packed together.
+ */
+void writeShuffleBlock(struct bookCodeStruct *bkCdSt)
+{
+    if (bkCdSt->bkCdShuffleBufPos == SHUFFLE_BLOCK_OFFSETS) {
+        writeBookCodeBytes(bkCdSt, bkCdSt->bkCdShuffleBuffer, SHUFFLE_BLOCK_OFFSETS * bkCdSt->bkCdOffsetBytes, LZMA_RUN);
+    } else {
+        for (size_t plane = 0; plane < bkCdSt->bkCdOffsetBytes; plane++) {
+            writeBookCodeBytes(bkCdSt, bkCdSt->bkCdShuffleBuffer + plane * SHUFFLE_BLOCK_OFFSETS, bkCdSt->bkCdShuffleBufPos, LZMA_RUN);
+        }
+    }
+    
+    bkCdSt->bkCdShuffleBufPos = 0;
+}
+
+/* Spreads each byte of the offsets into its own plane of the shuffle block before they are 
+ * compressed. The high bytes of nearby offsets are mostly the same, so they compress much better 
+ * when grouped together than when interleaved with the low bytes.
+ */
+void shuffleOffsets(struct bookCodeStruct *bkCdSt)
+{
+    for (size_t i = 0; i < bkCdSt->bkCdBufPos; i++) {
+        for (size_t plane = 0; plane < bkCdSt->bkCdOffsetBytes; plane++) {
+            bkCdSt->bkCdShuffleBuffer[plane * SHUFFLE_BLOCK_OFFSETS + bkCdSt->bkCdShuffleBufPos] = bkCdSt->bkCdBuffer[i] >> (plane * CHAR_BIT);
+        }
+        
+        if (++bkCdSt->bkCdShuffleBufPos == SHUFFLE_BLOCK_OFFSETS) {
+            writeShuffleBlock(bkCdSt);
+        }
+    }
+}
+
+/* Reads the next shuffled block and puts the bytes of each offset back together. Returns the 
+ * number of offsets in the block, which is 0 at the end of the book code.
+ */
+size_t unshuffleOffsets(struct bookCodeStruct *bkCdSt)
+{
+    size_t blockOffsets = readBookCodeBytes(bkCdSt, bkCdSt->bkCdShuffleBuffer, SHUFFLE_BLOCK_OFFSETS * bkCdSt->bkCdOffsetBytes) / bkCdSt->bkCdOffsetBytes;
+    
+    for (size_t i = 0; i < blockOffsets; i++) {
+        uoffset_t byteOffset = 0;
+        for (size_t plane = 0; plane < bkCdSt->bkCdOffsetBytes; plane++) {
+            byteOffset |= (uoffset_t)bkCdSt->bkCdShuffleBuffer[plane * blockOffsets + i] << (plane * CHAR_BIT);
+        }
+        bkCdSt->bkCdUnshuffled[i] = byteOffset;
+    }
+    
+    bkCdSt->bkCdShuffleBufPos = 0;
+    bkCdSt->bkCdShuffleBufLen = blockOffsets;
+    
+    return blockOffsets;
+}
+
+/* Ends the block of the book code container being written and starts the next one, noting where 
+ * it starts in the block index. Each block after the first starts a new xz stream when 
+ * compressing, and varint deltas start again from 0, so that a block can be decoded from its 
+ * own bytes alone.
+ */
+void startBookCodeBlock(struct bookCodeStruct *bkCdSt)
+{
+    if (bkCdSt->bkCdBlockCount > 0) {
+        if (bkCdSt->bkCdCompression != BOOK_CODE_UNCOMPRESSED) {
+            writeBookCodeBytes(bkCdSt, NULL, 0, LZMA_FINISH);
+            startBookCodeStream(bkCdSt, false);
+        }
+        
+        struct blockIndexEntryStruct *lastBlock = &bkCdSt->bkCdBlocks[bkCdSt->bkCdBlockCount - 1];
+        lastBlock->bkCdLength = bkCdSt->bkCdBytesWritten - lastBlock->bkCdPos;
+    }
+    
+    if (bkCdSt->bkCdBlockCount == bkCdSt->bkCdBlocksAllocated) {
+        bkCdSt->bkCdBlocksAllocated = bkCdSt->bkCdBlocksAllocated > 0 ? bkCdSt->bkCdBlocksAllocated * 2 : 64;
+        bkCdSt->bkCdBlocks = realloc(bkCdSt->bkCdBlocks, bkCdSt->bkCdBlocksAllocated * sizeof(struct blockIndexEntryStruct));
+        if (bkCdSt->bkCdBlocks == NULL) {
+            PRINT_SYS_ERROR(errno);
+            exit(EXIT_FAILURE);
+        }
+    }
+    
+    bkCdSt->bkCdBlocks[bkCdSt->bkCdBlockCount].bkCdPos = bkCdSt->bkCdBytesWritten;
+    bkCdSt->bkCdBlocks[bkCdSt->bkCdBlockCount].bkCdLength = 0;
+    bkCdSt->bkCdBlocks[bkCdSt->bkCdBlockCount].bkCdCrc = 0;
+    bkCdSt->bkCdBlocks[bkCdSt->bkCdBlockCount].orgFilCrc = bkCdSt->bkCdOrgFilCrcs[bkCdSt->bkCdBlockCount];
+    bkCdSt->bkCdBlockCount++;
+    bkCdSt->bkCdPrevOffset = 0;
+}
+
+/* Writes the block index and footer at the end of a book code container. They are never 
+ * compressed, so that they can be read straight from the end of the file.
+ */
+void writeBlockIndex(struct bookCodeStruct *bkCdSt)
+{
+    int returnVal = 0;
+    struct blockIndexFooterStruct footer = {0};
+    
+    if (bkCdSt->bkCdBlockCount > 0) {
+        struct blockIndexEntryStruct *lastBlock = &bkCdSt->bkCdBlocks[bkCdSt->bkCdBlockCount - 1];
+        lastBlock->bkCdLength = bkCdSt->bkCdBytesWritten - lastBlock->bkCdPos;
+    }
+    
+    footer.blockCount = bkCdSt->bkCdBlockCount;
+    footer.indexPos = bkCdSt->bkCdBytesWritten;
+    memcpy(footer.magic, BLOCK_INDEX_MAGIC, sizeof(footer.magic));
+    footer.version = BOOK_CODE_CONTAINER_VERSION;
+    
+    if((bkCdSt->bkCdBlockCount > 0 && fwriteWErrCheck(bkCdSt->bkCdBlocks, sizeof(struct blockIndexEntryStruct), bkCdSt->bkCdBlockCount, bkCdSt->bkCd, &returnVal) != 0)
+        || fwriteWErrCheck(&footer, sizeof(footer), 1, bkCdSt->bkCd, &returnVal) != 0) {
+        PRINT_SYS_ERROR(returnVal);
+        exit(EXIT_FAILURE);
+    }
+    
+    bkCdSt->bkCdBytesWritten += bkCdSt->bkCdBlockCount * sizeof(struct blockIndexEntryStruct) + sizeof(footer);
+}
+
+/* Reads the block index from the end of a book code container, which must be a file that can be 
+ * seeked in. The book code is left where it was.
+ */
+void readBlockIndex(struct bookCodeStruct *bkCdSt)
+{
+    struct blockIndexFooterStruct footer;
+    off_t bkCdPos = ftello(bkCdSt->bkCd);
+    
+    if (bkCdSt->bkCdSize < sizeof(footer) 
+        || fseeko(bkCdSt->bkCd, bkCdSt->bkCdSize - sizeof(footer), SEEK_SET) != 0 
+        || fread(&footer, sizeof(footer), 1, bkCdSt->bkCd) != 1
+        || memcmp(footer.magic, BLOCK_INDEX_MAGIC, sizeof(footer.magic)) != 0
+        || footer.version != BOOK_CODE_CONTAINER_VERSION
+        || footer.indexPos + footer.blockCount * sizeof(struct blockIndexEntryStruct) + sizeof(footer) != bkCdSt->bkCdSize
+        || footer.blockCount != (bkCdSt->bkCdContainerHeader.orgFilSize + bkCdSt->bkCdContainerHeader.blockOffsets - 1) / bkCdSt->bkCdContainerHeader.blockOffsets) {
+        fprintf(stderr,"The block index at the end of %s is missing or damaged\n", bkCdSt->bkCdFilName);
+        exit(EXIT_FAILURE);
+    }
+    
+    bkCdSt->bkCdBlockCount = footer.blockCount;
+    bkCdSt->bkCdBlocks = malloc(footer.blockCount * sizeof(struct blockIndexEntryStruct) + 1);
+    if (bkCdSt->bkCdBlocks == NULL) {
+        PRINT_SYS_ERROR(errno);
+        exit(EXIT_FAILURE);
+    }
+    
+    if (fseeko(bkCdSt->bkCd, footer.indexPos, SEEK_SET) != 0 
+        || fread(bkCdSt->bkCdBlocks, sizeof(struct blockIndexEntryStruct), footer.blockCount, bkCdSt->bkCd) != footer.blockCount
+        || fseeko(bkCdSt->bkCd, bkCdPos, SEEK_SET) != 0) {
+        PRINT_FILE_ERROR(bkCdSt->bkCdFilName,errno);
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* Moves a book code container to the start of one of its blocks, ready to decode it and the 
+ * blocks after it up to lastBlock. Nothing past lastBlock is read, so a damaged block after the 
+ * ones wanted doesn't stop them being decoded.
+ */
+void seekBookCodeBlock(struct bookCodeStruct *bkCdSt, uint64_t blockNumber, uint64_t lastBlock)
+{
+    if (fseeko(bkCdSt->bkCd, bkCdSt->bkCdBlocks[blockNumber].bkCdPos, SEEK_SET) != 0) {
+        PRINT_FILE_ERROR(bkCdSt->bkCdFilName,errno);
+        exit(EXIT_FAILURE);
+    }
+    
+    bkCdSt->bkCdCodedBufPos = bkCdSt->bkCdCodedBufLen = 0;
+    bkCdSt->bkCdPrevOffset = 0;
+    bkCdSt->bkCdOffsetCount = blockNumber * bkCdSt->bkCdContainerHeader.blockOffsets;
+    bkCdSt->bkCdOffsetsLeft = bkCdSt->bkCdContainerHeader.orgFilSize - bkCdSt->bkCdOffsetCount;
+    bkCdSt->bkCdEnd = false;
+    bkCdSt->bkCdReadEnd = bkCdSt->bkCdBlocks[lastBlock].bkCdPos + bkCdSt->bkCdBlocks[lastBlock].bkCdLength;
+    
+    if (bkCdSt->bkCdCompression != BOOK_CODE_UNCOMPRESSED) {
+        bkCdSt->bkCdShuffleBufPos = bkCdSt->bkCdShuffleBufLen = 0;
+        bkCdSt->bkCdLzma.avail_in = 0;
+        startBookCodeStream(bkCdSt, true);
+    }
+}
+
+/* Writes out anything still held back for compression and ends the compressed stream, followed 
+ * by the block index of a container
+ */
+void finishBookCode(struct bookCodeStruct *bkCdSt)
+{
+    if (bkCdSt->bkCdCompression != BOOK_CODE_UNCOMPRESSED) {
+        if (bkCdSt->bkCdFormat == BOOK_CODE_RAW && bkCdSt->bkCdShuffleBufPos > 0) {
+            writeShuffleBlock(bkCdSt);
+        }
+        
+        writeBookCodeBytes(bkCdSt, NULL, 0, LZMA_FINISH);
+    }
+    
+    if (bkCdSt->bkCdContainer) {
+        writeBlockIndex(bkCdSt);
+    }
+}
+
+void stopBookCodeCompression(struct bookCodeStruct *bkCdSt)
+{
+    lzma_end(&bkCdSt->bkCdLzma);
+    free(bkCdSt->bkCdCompressedBuffer);
+    free(bkCdSt->bkCdShuffleBuffer);
+    free(bkCdSt->bkCdUnshuffled);
+}
+
+/* Encodes each offset as the difference from the offset before it, zigzag encoded so that small 
+ * negative differences stay small, and written as a LEB128 varint. Since mapping mostly moves 
+ * forward through the book file a little at a time, most offsets take only 1 or 2 bytes.
+ */
+size_t encodeVarintOffsets(struct bookCodeStruct *bkCdSt)
+{
+    size_t codedLen = 0;
+    
+    for (size_t i = 0; i < bkCdSt->bkCdBufPos; i++) {
+        int64_t delta = (int64_t)bkCdSt->bkCdBuffer[i] - (int64_t)bkCdSt->bkCdPrevOffset;
+        uint64_t value = ((uint64_t)delta << 1) ^ (uint64_t)(delta >> 63);
+        
+        bkCdSt->bkCdPrevOffset = bkCdSt->bkCdBuffer[i];
+        
+        while (value >= 0x80) {
+            bkCdSt->bkCdCodedBuffer[codedLen++] = (value & 0x7F) | 0x80;
+            value >>= 7;
+        }
+        bkCdSt->bkCdCodedBuffer[codedLen++] = value;
+    }
+    
+    return codedLen;
+}
+
+/* Writes out the offsets collected in bkCdBuffer in one go */
+void writeBookCodeOffsets(struct bookCodeStruct *bkCdSt)
+{
+    if(bkCdSt->bkCdFormat == BOOK_CODE_VARINT) {
+        size_t codedLen = encodeVarintOffsets(bkCdSt);
+        writeBookCodeBytes(bkCdSt, bkCdSt->bkCdCodedBuffer, codedLen, LZMA_RUN);
+    } else if(bkCdSt->bkCdCompression != BOOK_CODE_UNCOMPRESSED) {
+        shuffleOffsets(bkCdSt);
+    } else {
+        bkCdSt->packOffsets(bkCdSt->bkCdBuffer, bkCdSt->bkCdCodedBuffer, bkCdSt->bkCdBufPos);
+        writeBookCodeBytes(bkCdSt, bkCdSt->bkCdCodedBuffer, bkCdSt->bkCdBufPos * bkCdSt->bkCdOffsetBytes, LZMA_RUN);
+    }
+}
+
+/* Writes out the offsets collected in bkCdBuffer and empties the buffer. In a container, they are 
+ * written in pieces that end where each block does.
+ */
+void flushBookCodeBuffer(struct bookCodeStruct *bkCdSt)
+{
+    if(bkCdSt->bkCdBufPos == 0) {
+        return;
+    }
+    
+    if(!bkCdSt->bkCdContainer) {
+        writeBookCodeOffsets(bkCdSt);
+        bkCdSt->bkCdOffsetCount += bkCdSt->bkCdBufPos;
+        bkCdSt->bkCdBufPos = 0;
+        return;
+    }
+    
+    uoffset_t *bkCdBuffer = bkCdSt->bkCdBuffer;
+    size_t remaining = bkCdSt->bkCdBufPos;
+    
+    while (remaining > 0) {
+        size_t blockOffsets = bkCdSt->bkCdContainerHeader.blockOffsets;
+        size_t blockPos = bkCdSt->bkCdOffsetCount % blockOffsets;
+        if (blockPos == 0) {
+            startBookCodeBlock(bkCdSt);
+        }
+        
+        size_t pieceOffsets = blockOffsets - blockPos < remaining ? blockOffsets - blockPos : remaining;
+        bkCdSt->bkCdBufPos = pieceOffsets;
+        writeBookCodeOffsets(bkCdSt);
+        
+        bkCdSt->bkCdBuffer += pieceOffsets;
+        bkCdSt->bkCdOffsetCount += pieceOffsets;
+        remaining -= pieceOffsets;
+    }
+    
+    bkCdSt->bkCdBuffer = bkCdBuffer;
+    bkCdSt->bkCdBufPos = 0;
+}
+
+/* Tops up the coded buffer from the book code, keeping whatever has not been decoded yet */
+void refillCodedBuffer(struct bookCodeStruct *bkCdSt)
+{
+    size_t remaining = bkCdSt->bkCdCodedBufLen - bkCdSt->bkCdCodedBufPos;
+    
+    memmove(bkCdSt->bkCdCodedBuffer, bkCdSt->bkCdCodedBuffer + bkCdSt->bkCdCodedBufPos, remaining);
+    bkCdSt->bkCdCodedBufPos = 0;
+    bkCdSt->bkCdCodedBufLen = remaining + readBookCodeBytes(bkCdSt, bkCdSt->bkCdCodedBuffer + remaining, bkCdSt->bkCdCodedBufSize - remaining);
+}
+
+size_t decodeVarintOffsets(struct bookCodeStruct *bkCdSt, uoffset_t *offsets, size_t maxOffsets)
+{
+    size_t count = 0;
+    
+    while (count < maxOffsets) {
+        
+        /* Make sure a whole varint is in the buffer unless the end of the book code was reached */
+        if (bkCdSt->bkCdCodedBufLen - bkCdSt->bkCdCodedBufPos < MAX_VARINT_BYTES && !bkCdSt->bkCdEnd) {
+            refillCodedBuffer(bkCdSt);
+        }
+        
+        if (bkCdSt->bkCdCodedBufPos == bkCdSt->bkCdCodedBufLen) {
+            break;
+        }
+        
+        uint64_t value = 0;
+        int shift = 0;
+        byte_t codedByte;
+        do {
+            if (bkCdSt->bkCdCodedBufPos == bkCdSt->bkCdCodedBufLen || shift >= 64) {
+                fprintf(stderr,"Book code is truncated or damaged\n");
+                exit(EXIT_FAILURE);
+            }
+            codedByte = bkCdSt->bkCdCodedBuffer[bkCdSt->bkCdCodedBufPos++];
+            value |= (uint64_t)(codedByte & 0x7F) << shift;
+            shift += 7;
+        } while (codedByte & 0x80);
+        
+        int64_t delta = (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+        bkCdSt->bkCdPrevOffset += delta;
+        offsets[count++] = bkCdSt->bkCdPrevOffset;
+    }
+    
+    return count;
+}
+
+/* Decodes up to maxOffsets of the next offsets from the book code into offsets, from whatever 
+ * format it is in, and returns how many there were. Returns 0 at the end of the book code.
+ */
+size_t decodeBookCodeOffsets(struct bookCodeStruct *bkCdSt, uoffset_t *offsets, size_t maxOffsets)
+{
+    if (bkCdSt->bkCdFormat == BOOK_CODE_VARINT) {
+        return decodeVarintOffsets(bkCdSt, offsets, maxOffsets);
+    }
+    
+    if (bkCdSt->bkCdCompression != BOOK_CODE_UNCOMPRESSED) {
+        size_t count = 0;
+        
+        while (count < maxOffsets) {
+            if (bkCdSt->bkCdShuffleBufPos == bkCdSt->bkCdShuffleBufLen && unshuffleOffsets(bkCdSt) == 0) {
+                break;
+            }
+            
+            size_t blockOffsets = bkCdSt->bkCdShuffleBufLen - bkCdSt->bkCdShuffleBufPos;
+            if (blockOffsets > maxOffsets - count) {
+                blockOffsets = maxOffsets - count;
+            }
+            
+            memcpy(offsets + count, bkCdSt->bkCdUnshuffled + bkCdSt->bkCdShuffleBufPos, blockOffsets * sizeof(uoffset_t));
+            bkCdSt->bkCdShuffleBufPos += blockOffsets;
+            count += blockOffsets;
+        }
+        
+        return count;
+    }
+    
+    /* Bytes that were read while looking for a header belong to the first offset */
+    size_t bytesRead = bkCdSt->bkCdCodedBufLen - bkCdSt->bkCdCodedBufPos;
+    memmove(bkCdSt->bkCdCodedBuffer, bkCdSt->bkCdCodedBuffer + bkCdSt->bkCdCodedBufPos, bytesRead);
+    bkCdSt->bkCdCodedBufPos = bkCdSt->bkCdCodedBufLen = 0;
+    
+    bytesRead += readBookCodeBytes(bkCdSt, bkCdSt->bkCdCodedBuffer + bytesRead, maxOffsets * bkCdSt->bkCdOffsetBytes - bytesRead);
+    
+    /* Every offset sized chunk of the book code represents 1 byte of the original file */
+    bkCdSt->unpackOffsets(bkCdSt->bkCdCodedBuffer, offsets, bytesRead / bkCdSt->bkCdOffsetBytes);
+    
+    return bytesRead / bkCdSt->bkCdOffsetBytes;
+}
+
+/* Fills bkCdBuffer with the next offsets from the book code and returns how many there were, 
+ * which is 0 at the end of the book code. A container is decoded a block at a time, so that 
+ * varint deltas start again at the start of each block, and only as many offsets are read as 
+ * its header says there are.
+ */
+size_t readBookCodeOffsets(struct bookCodeStruct *bkCdSt)
+{
+    size_t bkCdBufOffsets = bkCdSt->bkCdBufSize / sizeof(*bkCdSt->bkCdBuffer);
+    
+    if (!bkCdSt->bkCdContainer) {
+        return decodeBookCodeOffsets(bkCdSt, bkCdSt->bkCdBuffer, bkCdBufOffsets);
+    }
+    
+    size_t count = 0;
+    size_t blockOffsets = bkCdSt->bkCdContainerHeader.blockOffsets;
+    
+    while (count < bkCdBufOffsets && bkCdSt->bkCdOffsetsLeft > 0) {
+        size_t maxOffsets = bkCdBufOffsets - count;
+        if (maxOffsets > blockOffsets - bkCdSt->bkCdOffsetCount % blockOffsets) {
+            maxOffsets = blockOffsets - bkCdSt->bkCdOffsetCount % blockOffsets;
+        }
+        if (maxOffsets > bkCdSt->bkCdOffsetsLeft) {
+            maxOffsets = bkCdSt->bkCdOffsetsLeft;
+        }
+        
+        size_t decoded = decodeBookCodeOffsets(bkCdSt, bkCdSt->bkCdBuffer + count, maxOffsets);
+        if (decoded == 0) {
+            fprintf(stderr,"Book code is truncated or damaged, %lu offsets are missing\n", (uint64_t)bkCdSt->bkCdOffsetsLeft);
+            exit(EXIT_FAILURE);
+        }
+        
+        count += decoded;
+        bkCdSt->bkCdOffsetCount += decoded;
+        bkCdSt->bkCdOffsetsLeft -= decoded;
+        
+        if (bkCdSt->bkCdOffsetCount % blockOffsets == 0) {
+            bkCdSt->bkCdPrevOffset = 0;
+        }
+    }
+    
+    return count;
+}
+
+/* Reads and throws away the rest of the container block that the last offsets were read from, so 
+ * that a range ending part way through a block still has the whole block checked against its CRC
+ */
+void finishBookCodeBlock(struct bookCodeStruct *bkCdSt)
+{
+    size_t bkCdBufOffsets = bkCdSt->bkCdBufSize / sizeof(*bkCdSt->bkCdBuffer);
+    size_t blockOffsets = bkCdSt->bkCdContainerHeader.blockOffsets;
+    
+    while (bkCdSt->bkCdOffsetCount % blockOffsets != 0 && bkCdSt->bkCdOffsetsLeft > 0) {
+        size_t maxOffsets = blockOffsets - bkCdSt->bkCdOffsetCount % blockOffsets;
+        if (maxOffsets > bkCdBufOffsets) {
+            maxOffsets = bkCdBufOffsets;
+        }
+        if (maxOffsets > bkCdSt->bkCdOffsetsLeft) {
+            maxOffsets = bkCdSt->bkCdOffsetsLeft;
+        }
+        
+        size_t decoded = decodeBookCodeOffsets(bkCdSt, bkCdSt->bkCdBuffer, maxOffsets);
+        if (decoded == 0) {
+            fprintf(stderr,"Book code is truncated or damaged, %lu offsets are missing\n", (uint64_t)bkCdSt->bkCdOffsetsLeft);
+            exit(EXIT_FAILURE);
+        }
+        
+        bkCdSt->bkCdOffsetCount += decoded;
+        bkCdSt->bkCdOffsetsLeft -= decoded;
+    }
+}
+
+/* Moves the book code to as close before the start of the range to extract as it can, and returns 
+ * how many offsets are left to be read and skipped from there. Raw book codes are seeked straight 
+ * to the first offset and containers to the start of the block holding it, so that the block can 
+ * be checked against its CRC. Other book codes are read from the start.
+ */
+uint64_t seekBookCodeRange(struct bookCodeStruct *bkCdSt, struct optionsStruct *optSt)
+{
+    if (optSt->readFromStdin) {
+        return optSt->rangeStart;
+    }
+    
+    if (bkCdSt->bkCdFormat == BOOK_CODE_RAW && bkCdSt->bkCdCompression == BOOK_CODE_UNCOMPRESSED && !bkCdSt->bkCdContainer) {
+        /* Bytes read while looking for a header are where the offsets start */
+        off_t bkCdStart = ftello(bkCdSt->bkCd) - bkCdSt->bkCdCodedBufLen;
+        
+        if (fseeko(bkCdSt->bkCd, bkCdStart + optSt->rangeStart * bkCdSt->bkCdOffsetBytes, SEEK_SET) != 0) {
+            PRINT_FILE_ERROR(bkCdSt->bkCdFilName,errno);
+            exit(EXIT_FAILURE);
+        }
+        bkCdSt->bkCdCodedBufPos = bkCdSt->bkCdCodedBufLen = 0;
+        
+        return 0;
+    }
+    
+    if (!bkCdSt->bkCdContainer) {
+        if(optSt->verbosityLevel >= 1) {
+            fprintf(stderr,"Book code is not a container, so it is read from the start to get to the range\n");
+        }
+        return optSt->rangeStart;
+    }
+    
+    if (optSt->rangeStart >= bkCdSt->bkCdContainerHeader.orgFilSize) {
+        bkCdSt->bkCdOffsetsLeft = 0;
+        return 0;
+    }
+    
+    /* Only the blocks holding the range are decoded */
+    uint64_t rangeEnd = bkCdSt->bkCdContainerHeader.orgFilSize;
+    if (optSt->rangeLength < rangeEnd - optSt->rangeStart) {
+        rangeEnd = optSt->rangeStart + optSt->rangeLength;
+    }
+    uint64_t blockNumber = optSt->rangeStart / bkCdSt->bkCdContainerHeader.blockOffsets;
+    uint64_t lastBlock = (rangeEnd - 1) / bkCdSt->bkCdContainerHeader.blockOffsets;
+    if (lastBlock >= bkCdSt->bkCdBlockCount) {
+        lastBlock = bkCdSt->bkCdBlockCount - 1;
+    }
+    seekBookCodeBlock(bkCdSt, blockNumber, lastBlock);
+    
+    if(optSt->verbosityLevel >= 1) {
+        fprintf(stderr,"Starting at block %lu of the book code, %lu bytes in\n", (uint64_t)blockNumber, (uint64_t)bkCdSt->bkCdBlocks[blockNumber].bkCdPos);
+    }
+    
+    return optSt->rangeStart - bkCdSt->bkCdOffsetCount;
+}
+
+/* The used offset map has one bit for every offset of the book file, set once the offset has 
+ * been written to the book code. It is mapped anonymously so that the kernel only hands out 
+ * zeroed pages for the parts of it that get touched, and a large book that is only partly used 
+ * doesn't cost its whole size in memory.
+ */
+void allocUsedOffsetMap(struct bookFileStruct *bkFilSt, size_t bkFilSize)
+{
+    bkFilSt->bkFilUsedMapSize = (bkFilSize + 63) / 64 * sizeof(uint64_t);
+    bkFilSt->bkFilUsedMap = mmap(NULL, bkFilSt->bkFilUsedMapSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (bkFilSt->bkFilUsedMap == MAP_FAILED) {
+        PRINT_SYS_ERROR(errno);
+        exit(EXIT_FAILURE);
+    }
+}
+
+void freeUsedOffsetMap(struct bookFileStruct *bkFilSt)
+{
+    if (bkFilSt->bkFilUsedMap != NULL) {
+        munmap(bkFilSt->bkFilUsedMap, bkFilSt->bkFilUsedMapSize);
+        bkFilSt->bkFilUsedMap = NULL;
+    }
+}
+
+/* Returns true if offset was already used, and otherwise marks it as used */
+bool testAndSetUsedOffset(uint64_t *bkFilUsedMap, uoffset_t offset)
+{
+    uint64_t bit = (uint64_t)1 << (offset & 63);
+    uint64_t *word = &bkFilUsedMap[offset >> 6];
+    
+    if (*word & bit) {
+        return true;
+    }
+    
+    *word |= bit;
+    return false;
+}
+
+/* Reads count bytes at offset into buffer with pread, retrying short reads. Returns the number of 
+ * bytes read, which is only less than count if the end of the file was reached.
+ */
+size_t preadFully(int fd, byte_t *buffer, size_t count, off_t offset)
+{
+    size_t bytesRead = 0;
+    
+    while (bytesRead < count) {
+        ssize_t result = pread(fd, buffer + bytesRead, count - bytesRead, offset + bytesRead);
+        if (result == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            PRINT_SYS_ERROR(errno);
+            exit(EXIT_FAILURE);
+        } else if (result == 0) {
+            break;
+        }
+        bytesRead += result;
+    }
+    
+    return bytesRead;
+}
+
+/* Hashes chunks of a file with CRC-64 until there are none left, also working out the CRC-32C 
+ * of each block of the chunks if asked to
+ */
+void *hashWorker(void *arg)
+{
+    struct hashPoolStruct *pool = arg;
+    uint64_t chunk;
+    
+    byte_t *buffer = malloc(HASH_CHUNK_SIZE);
+    if (buffer == NULL) {
+        PRINT_SYS_ERROR(errno);
+        exit(EXIT_FAILURE);
+    }
+    
+    while ((chunk = atomic_fetch_add(&pool->nextChunk, 1)) < pool->chunkCount) {
+        uint64_t chunkStart = chunk * HASH_CHUNK_SIZE;
+        size_t chunkSize = pool->fileSize - chunkStart < HASH_CHUNK_SIZE ? pool->fileSize - chunkStart : HASH_CHUNK_SIZE;
+        
+        if (preadFully(pool->fileDescriptor, buffer, chunkSize, chunkStart) != chunkSize) {
+            fprintf(stderr,"File became shorter while it was being hashed\n");
+            exit(EXIT_FAILURE);
+        }
+        pool->chunkHashes[chunk] = lzma_crc64(buffer, chunkSize, 0);
+        
+        if (pool->blockCrcs != NULL) {
+            for (size_t blockStart = 0; blockStart < chunkSize; blockStart += pool->blockSize) {
+                size_t blockSize = chunkSize - blockStart < pool->blockSize ? chunkSize - blockStart : pool->blockSize;
+                pool->blockCrcs[(chunkStart + blockStart) / pool->blockSize] = crc32c(0, buffer + blockStart, blockSize);
+            }
+        }
+    }
+    
+    free(buffer);
+    
+    return NULL;
+}
+
+/* Hashes a whole file as a tree, with threadCount threads taking HASH_CHUNK_SIZE chunks of it to 
+ * hash with CRC-64, and the hash of the file being the CRC-64 of the hashes of its chunks in 
+ * order. The hash is the same however many threads work it out. If blockCrcs isn't NULL, the 
+ * CRC-32C of every blockSize bytes of the file is put in it as well, which blockSize has to divide 
+ * HASH_CHUNK_SIZE for.
+ */
+uint64_t hashFile(const char *fileName, int threadCount, uint32_t *blockCrcs, size_t blockSize)
+{
+    struct hashPoolStruct pool;
+    
+    pool.blockCrcs = blockCrcs;
+    pool.blockSize = blockSize;
+    
+    pool.fileDescriptor = open(fileName, O_RDONLY);
+    if (pool.fileDescriptor == -1) {
+        PRINT_FILE_ERROR(fileName,errno);
+        exit(EXIT_FAILURE);
+    }
+    
+    pool.fileSize = getFileSize(fileName);
+    pool.chunkCount = (pool.fileSize + HASH_CHUNK_SIZE - 1) / HASH_CHUNK_SIZE;
+    atomic_init(&pool.nextChunk, 0);
+    pool.chunkHashes = calloc(pool.chunkCount + 1, sizeof(uint64_t));
+    
+    if (threadCount < 1) {
+        threadCount = 1;
+    }
+    if ((uint64_t)threadCount > pool.chunkCount) {
+        threadCount = pool.chunkCount > 0 ? pool.chunkCount : 1;
+    }
+    
+    pthread_t *threads = calloc(threadCount, sizeof(pthread_t));
+    if (pool.chunkHashes == NULL || threads == NULL) {
+        PRINT_SYS_ERROR(errno);
+        exit(EXIT_FAILURE);
+    }
+    
+    for (int i = 0; i < threadCount; i++) {
+        int errCode = pthread_create(&threads[i], NULL, hashWorker, &pool);
+        if (errCode != 0) {
+            PRINT_SYS_ERROR(errCode);
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (int i = 0; i < threadCount; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    
+    uint64_t hash = lzma_crc64((byte_t *)pool.chunkHashes, pool.chunkCount * sizeof(uint64_t), 0);
+    
+    close(pool.fileDescriptor);
+    free(pool.chunkHashes);
+    free(threads);
+    
+    return hash;
+}
+
+void *bookReadAheadWorker(void *arg)
+{
+    struct bookReadAheadStruct *readAhead = arg;
+    
+    pthread_mutex_lock(&readAhead->lock);
+    for (;;) {
+        while (!readAhead->pending && !readAhead->quit) {
+            pthread_cond_wait(&readAhead->cond, &readAhead->lock);
+        }
+        if (readAhead->quit) {
+            break;
+        }
+        off_t requestedPos = readAhead->requestedPos;
+        pthread_mutex_unlock(&readAhead->lock);
+        
+        size_t bytesRead = preadFully(readAhead->bkFilDescriptor, readAhead->buffer, readAhead->bufSize, requestedPos);
+        
+        pthread_mutex_lock(&readAhead->lock);
+        readAhead->bytesRead = bytesRead;
+        readAhead->pending = false;
+        pthread_cond_broadcast(&readAhead->cond);
+    }
+    pthread_mutex_unlock(&readAhead->lock);
+    
+    return NULL;
+}
+
+size_t bytesOfRamAvailable(void) {
+    FILE *meminfoFile = fopen("/proc/meminfo", "r");
+    if(meminfoFile == NULL) {
+        PRINT_FILE_ERROR("/proc/meminfo",errno);
+        exit(EXIT_FAILURE);
+    }
+
+    char meminfoLine[256];
+    while(fgets(meminfoLine, sizeof(meminfoLine), meminfoFile))
+    {
+        size_t availableMemory;
+        if(sscanf(meminfoLine, "MemAvailable: %lu kB", &availableMemory) == 1)
+        {
+            fclose(meminfoFile);
+            return availableMemory * 1024;
+        }
+    }
+
+    fclose(meminfoFile);
+    
+    printf("Could not read available system memory\n");
+    
+    exit(EXIT_FAILURE);
+    
+}
+
+/* Reading ahead only helps if mapping moves on to other buffers of the book file, which it never 
+ * does with reset-at-buffer. When the book file is in the page cache, handing each read to another 
+ * thread costs more than it saves, so it is only done by default when the book file is too large 
+ * to stay in memory
+ */
+bool useBookReadAhead(struct bookFileStruct *bkFilSt, struct optionsStruct *optSt)
+{
+    return !optSt->resetAtEndOfBuf && bkFilSt->bkFilBufSize >= BACKGROUND_IO_MIN_BUFFER_SIZE && bkFilSt->bkFilSize > bkFilSt->bkFilBufSize && (optSt->readAhead || bkFilSt->bkFilSize > bytesOfRamAvailable());
+}
+
+void startBookReadAhead(struct bookReadAheadStruct *readAhead, struct bookFileStruct *bkFilSt)
+{
+    readAhead->bkFilDescriptor = fileno(bkFilSt->bkFil);
+    readAhead->bkFilBuffer = bkFilSt->bkFilBuffer;
+    readAhead->bufSize = bkFilSt->bkFilBufSize;
+    readAhead->pending = false;
+    readAhead->quit = false;
+    readAhead->buffer = malloc(readAhead->bufSize);
+    if (readAhead->buffer == NULL) {
+        PRINT_SYS_ERROR(errno);
+        exit(EXIT_FAILURE);
+    }
+    
+    pthread_mutex_init(&readAhead->lock, NULL);
+    pthread_cond_init(&readAhead->cond, NULL);
+    
+    int errCode = pthread_create(&readAhead->thread, NULL, bookReadAheadWorker, readAhead);
+    if (errCode != 0) {
+        PRINT_SYS_ERROR(errCode);
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* Has the buffer that starts bkFilPos bytes into the book file read in the background */
+void requestBookReadAhead(struct bookReadAheadStruct *readAhead, struct bookFileStruct *bkFilSt, uoffset_t bkFilPos)
+{
+    pthread_mutex_lock(&readAhead->lock);
+    readAhead->requestedPos = bkFilSt->bkFilStart + bkFilPos;
+    readAhead->pending = true;
+    pthread_cond_broadcast(&readAhead->cond);
+    pthread_mutex_unlock(&readAhead->lock);
+}
+
+/* Waits for the requested buffer and swaps it in as the book file buffer, handing the one that 
+ * was just used back to be read into next
+ */
+void takeBookReadAhead(struct bookReadAheadStruct *readAhead, struct bookFileStruct *bkFilSt)
+{
+    pthread_mutex_lock(&readAhead->lock);
+    while (readAhead->pending) {
+        pthread_cond_wait(&readAhead->cond, &readAhead->lock);
+    }
+    pthread_mutex_unlock(&readAhead->lock);
+    
+    if (readAhead->bytesRead != readAhead->bufSize) {
+        PRINT_FILE_ERROR(bkFilSt->bkFilName,EIO);
+        exit(EXIT_FAILURE);
+    }
+    
+    byte_t *bkFilBuffer = bkFilSt->bkFilBuffer;
+    bkFilSt->bkFilBuffer = readAhead->buffer;
+    readAhead->buffer = bkFilBuffer;
+}
+
+/* The book file buffer that mapping started with is put back, so that whoever allocated it frees 
+ * the right one
+ */
+void stopBookReadAhead(struct bookReadAheadStruct *readAhead, struct bookFileStruct *bkFilSt)
+{
+    pthread_mutex_lock(&readAhead->lock);
+    while (readAhead->pending) {
+        pthread_cond_wait(&readAhead->cond, &readAhead->lock);
+    }
+    readAhead->quit = true;
+    pthread_cond_broadcast(&readAhead->cond);
+    pthread_mutex_unlock(&readAhead->lock);
+    
+    pthread_join(readAhead->thread, NULL);
+    pthread_mutex_destroy(&readAhead->lock);
+    pthread_cond_destroy(&readAhead->cond);
+    
+    if (bkFilSt->bkFilBuffer != readAhead->bkFilBuffer) {
+        readAhead->buffer = bkFilSt->bkFilBuffer;
+        bkFilSt->bkFilBuffer = readAhead->bkFilBuffer;
+    }
+    free(readAhead->buffer);
+}
+
+/* The buffer mapping moves on to after the one at bkFilPos, going back to the start at the end 
+ * of the book file
+ */
+uoffset_t nextBookBufferPos(struct bookFileStruct *bkFilSt, uoffset_t bkFilPos)
+{
+    bkFilPos += bkFilSt->bkFilBufSize;
+    return bkFilPos >= (bkFilSt->bkFilSize - 1) ? 0 : bkFilPos;
+}
+
+void initPipelineRing(struct pipelineRingStruct *ring)
+{
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    atomic_init(&ring->producerWaiting, false);
+    atomic_init(&ring->consumerWaiting, false);
+    pthread_mutex_init(&ring->lock, NULL);
+    pthread_cond_init(&ring->cond, NULL);
+}
+
+void destroyPipelineRing(struct pipelineRingStruct *ring)
+{
+    pthread_mutex_destroy(&ring->lock);
+    pthread_cond_destroy(&ring->cond);
+}
+
+/* Sleeps until there is room in the ring for the producer, or something in it for the consumer. 
+ * The waiting flag is set before checking again, so the other side either sees it and wakes this 
+ * one or has already moved its index where the check will see it.
+ */
+void waitOnPipelineRing(struct pipelineRingStruct *ring, bool producer)
+{
+    atomic_bool *waiting = producer ? &ring->producerWaiting : &ring->consumerWaiting;
+    
+    pthread_mutex_lock(&ring->lock);
+    for (;;) {
+        atomic_store(waiting, true);
+        size_t used = atomic_load(&ring->tail) - atomic_load(&ring->head);
+        if (producer ? used < PIPELINE_SLOTS : used > 0) {
+            break;
+        }
+        pthread_cond_wait(&ring->cond, &ring->lock);
+    }
+    atomic_store(waiting, false);
+    pthread_mutex_unlock(&ring->lock);
+}
+
+void wakePipelineRing(struct pipelineRingStruct *ring, atomic_bool *waiting)
+{
+    if (atomic_load(waiting)) {
+        pthread_mutex_lock(&ring->lock);
+        pthread_cond_broadcast(&ring->cond);
+        pthread_mutex_unlock(&ring->lock);
+    }
+}
+
+/* Returns the slot for the producer to fill next, once the consumer is done with it */
+size_t producePipelineSlot(struct pipelineRingStruct *ring)
+{
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    if (tail - atomic_load_explicit(&ring->head, memory_order_acquire) == PIPELINE_SLOTS) {
+        waitOnPipelineRing(ring, true);
+    }
+    return tail % PIPELINE_SLOTS;
+}
+
+void publishPipelineSlot(struct pipelineRingStruct *ring, size_t length)
+{
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    ring->lengths[tail % PIPELINE_SLOTS] = length;
+    atomic_store(&ring->tail, tail + 1);
+    wakePipelineRing(ring, &ring->consumerWaiting);
+}
+
+/* Returns the slot for the consumer to empty next, once the producer has filled it */
+size_t consumePipelineSlot(struct pipelineRingStruct *ring)
+{
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    if (atomic_load_explicit(&ring->tail, memory_order_acquire) == head) {
+        waitOnPipelineRing(ring, false);
+    }
+    return head % PIPELINE_SLOTS;
+}
+
+void releasePipelineSlot(struct pipelineRingStruct *ring)
+{
+    atomic_store(&ring->head, atomic_load_explicit(&ring->head, memory_order_relaxed) + 1);
+    wakePipelineRing(ring, &ring->producerWaiting);
+}
+
+void *originalFileReader(void *arg)
+{
+    struct mapPipelineStruct *pipeline = arg;
+    struct originalFileStruct *orgFilSt = pipeline->orgFilSt;
+    int returnVal = 0;
+    
+    size_t bytesRemaining = orgFilSt->orgFilSize;
+    size_t currentChunk = orgFilSt->orgFilBufSize;
+    for (; bytesRemaining; bytesRemaining -= currentChunk) {
+        if(currentChunk > bytesRemaining) {
+            currentChunk = bytesRemaining;
+        }
+        
+        size_t slot = producePipelineSlot(&pipeline->orgFilRing);
+        if(freadWErrCheck(pipeline->orgFilRing.slots[slot], 1, sizeof(byte_t) * currentChunk, orgFilSt->orgFil, &returnVal) != 0) {
+            PRINT_SYS_ERROR(returnVal);
+            exit(EXIT_FAILURE);
+        }
+        publishPipelineSlot(&pipeline->orgFilRing, currentChunk);
+    }
+    
+    return NULL;
+}
+
+/* Writes out book code buffers until an empty one marks the end */
+void *bookCodeWriter(void *arg)
+{
+    struct mapPipelineStruct *pipeline = arg;
+    struct bookCodeStruct *bkCdSt = pipeline->bkCdSt;
+    
+    for (;;) {
+        size_t slot = consumePipelineSlot(&pipeline->bkCdRing);
+        if (pipeline->bkCdRing.lengths[slot] == 0) {
+            break;
+        }
+        
+        bkCdSt->bkCdBuffer = pipeline->bkCdRing.slots[slot];
+        bkCdSt->bkCdBufPos = pipeline->bkCdRing.lengths[slot];
+        flushBookCodeBuffer(bkCdSt);
+        
+        releasePipelineSlot(&pipeline->bkCdRing);
+    }
+    
+    return NULL;
+}
+
+/* The pipeline is only worth its threads for a single mapping thread with large enough buffers, and 
+ * only when reading or writing would otherwise keep the search waiting, which only the user can know
+ */
+bool useMapPipeline(struct originalFileStruct *orgFilSt, struct bookCodeStruct *bkCdSt, struct optionsStruct *optSt)
+{
+    return optSt->pipeline && optSt->threadCount <= 1 && orgFilSt->orgFilBufSize >= BACKGROUND_IO_MIN_BUFFER_SIZE && bkCdSt->bkCdBufSize >= BACKGROUND_IO_MIN_BUFFER_SIZE;
+}
+
+/* The buffers already allocated for the original file and book code become the first slot of 
+ * each ring
+ */
+void startMapPipeline(struct mapPipelineStruct *pipeline, struct originalFileStruct *orgFilSt, struct bookCodeStruct *bkCdSt)
+{
+    pipeline->orgFilSt = orgFilSt;
+    pipeline->bkCdSt = bkCdSt;
+    pipeline->orgFilBuffer = orgFilSt->orgFilBuffer;
+    pipeline->bkCdBuffer = bkCdSt->bkCdBuffer;
+    
+    initPipelineRing(&pipeline->orgFilRing);
+    initPipelineRing(&pipeline->bkCdRing);
+    
+    pipeline->orgFilRing.slots[0] = orgFilSt->orgFilBuffer;
+    pipeline->bkCdRing.slots[0] = bkCdSt->bkCdBuffer;
+    for (int i = 1; i < PIPELINE_SLOTS; i++) {
+        pipeline->orgFilRing.slots[i] = malloc(orgFilSt->orgFilBufSize);
+        pipeline->bkCdRing.slots[i] = malloc(bkCdSt->bkCdBufSize);
+        if (pipeline->orgFilRing.slots[i] == NULL || pipeline->bkCdRing.slots[i] == NULL) {
+            PRINT_SYS_ERROR(errno);
+            exit(EXIT_FAILURE);
+        }
+    }
+    
+    pipeline->mapperBkCdSt = *bkCdSt;
+    pipeline->mapperBkCdSt.bkCdBuffer = pipeline->bkCdRing.slots[producePipelineSlot(&pipeline->bkCdRing)];
+    pipeline->mapperBkCdSt.bkCdBufPos = 0;
+    
+    int errCode = pthread_create(&pipeline->readerThread, NULL, originalFileReader, pipeline);
+    if (errCode == 0) {
+        errCode = pthread_create(&pipeline->writerThread, NULL, bookCodeWriter, pipeline);
+    }
+    if (errCode != 0) {
+        PRINT_SYS_ERROR(errCode);
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* Points the original file buffer at the next chunk read by the reader thread */
+void takeOriginalFileChunk(struct mapPipelineStruct *pipeline, struct originalFileStruct *orgFilSt)
+{
+    pipeline->orgFilSlot = consumePipelineSlot(&pipeline->orgFilRing);
+    orgFilSt->orgFilBuffer = pipeline->orgFilRing.slots[pipeline->orgFilSlot];
+}
+
+/* Hands the mapper's book code buffer to the writer thread and moves on to the next free one */
+void queueBookCodeBuffer(struct mapPipelineStruct *pipeline)
+{
+    struct bookCodeStruct *mapperBkCdSt = &pipeline->mapperBkCdSt;
+    
+    if (mapperBkCdSt->bkCdBufPos == 0) {
+        return;
+    }
+    
+    publishPipelineSlot(&pipeline->bkCdRing, mapperBkCdSt->bkCdBufPos);
+    mapperBkCdSt->bkCdBuffer = pipeline->bkCdRing.slots[producePipelineSlot(&pipeline->bkCdRing)];
+    mapperBkCdSt->bkCdBufPos = 0;
+}
+
+/* Queues whatever is left of the book code and waits for it to be written. The buffers that were 
+ * there before the pipeline started are put back, so that they are freed where they were 
+ * allocated.
+ */
+void stopMapPipeline(struct mapPipelineStruct *pipeline)
+{
+    queueBookCodeBuffer(pipeline);
+    publishPipelineSlot(&pipeline->bkCdRing, 0);
+    
+    pthread_join(pipeline->readerThread, NULL);
+    pthread_join(pipeline->writerThread, NULL);
+    
+    for (int i = 0; i < PIPELINE_SLOTS; i++) {
+        if (pipeline->orgFilRing.slots[i] != pipeline->orgFilBuffer) {
+            free(pipeline->orgFilRing.slots[i]);
+        }
+        if (pipeline->bkCdRing.slots[i] != pipeline->bkCdBuffer) {
+            free(pipeline->bkCdRing.slots[i]);
+        }
+    }
+    destroyPipelineRing(&pipeline->orgFilRing);
+    destroyPipelineRing(&pipeline->bkCdRing);
+    
+    pipeline->orgFilSt->orgFilBuffer = pipeline->orgFilBuffer;
+    pipeline->bkCdSt->bkCdBuffer = pipeline->bkCdBuffer;
+    pipeline->bkCdSt->bkCdBufPos = 0;
+}
+
+/* Adds an offset to the current block of offsets, adding up the span of the book file it covers 
+ * once it is full
+ */
+void trackLocality(struct offsetStruct *oSetSt, uoffset_t byteOffset)
+{
+    if (oSetSt->localityBlockCount == 0 || byteOffset < oSetSt->localityBlockMin) {
+        oSetSt->localityBlockMin = byteOffset;
+    }
+    if (oSetSt->localityBlockCount == 0 || byteOffset > oSetSt->localityBlockMax) {
+        oSetSt->localityBlockMax = byteOffset;
+    }
+    
+    if (++oSetSt->localityBlockCount == LOCALITY_BLOCK_OFFSETS) {
+        oSetSt->localitySpanTotal += oSetSt->localityBlockMax - oSetSt->localityBlockMin + 1;
+        oSetSt->localityBlocks++;
+        oSetSt->localityBlockCount = 0;
+    }
+}
+
+/* A book code shorter than one block is measured by what there is of it */
+void finishLocality(struct offsetStruct *oSetSt)
+{
+    if (oSetSt->localityBlocks == 0 && oSetSt->localityBlockCount > 0) {
+        oSetSt->localitySpanTotal += oSetSt->localityBlockMax - oSetSt->localityBlockMin + 1;
+        oSetSt->localityBlocks++;
+    }
+    oSetSt->localityBlockCount = 0;
+}
+
+int mapOffsets(
+struct bookFileStruct *bkFilSt,
+struct bookCodeStruct *bkCdSt, 
+struct originalFileStruct *orgFilSt,
+struct offsetStruct *oSetSt,
+struct optionsStruct *optSt
+)
+{
+    int returnVal = 0;
+    int repeatsFound = 0;
+    size_t bkCdBufOffsets = bkCdSt->bkCdBufSize / sizeof(oSetSt->byteOffset);
+    
+    /* Every buffer of the book file can be searched once for a byte before giving up on it, or 
+     * just the one buffer with reset-at-buffer. The search for a byte starts partway into a buffer, 
+     * so the refill that ends the first buffer doesn't count as a full one.
+     */
+    size_t refillsWithoutMapping = 0;
+    size_t maxRefillsWithoutMapping = optSt->resetAtEndOfBuf ? 1 : bkFilSt->bkFilSize / bkFilSt->bkFilBufSize;
+    
+    /* With a sliding window, each buffer of the book file takes the offsets of a run of 
+     * bytesPerWindow bytes of the original file, which grows with the window, so the part of the 
+     * book that a run of offsets spans shrinks with the window. A buffer is searched again from its 
+     * start before sliding on to the next one, so giving up takes two refills per buffer.
+     */
+    size_t windowCount = bkFilSt->bkFilSize / bkFilSt->bkFilBufSize;
+    size_t bytesPerWindow = bkFilSt->bkFilBufSize * SLIDING_WINDOW_RUN;
+    size_t windowBytesMapped = 0;
+    bool windowWrapped = false;
+    if (optSt->slidingWindow) {
+        maxRefillsWithoutMapping = windowCount * 2 + 1;
+    }
+    
+    /*Prime the bkFilBuffer before starting the loop*/
+    if(freadWErrCheck(bkFilSt->bkFilBuffer, 1, sizeof(byte_t) * bkFilSt->bkFilBufSize, bkFilSt->bkFil, &returnVal) != 0) {
+        PRINT_SYS_ERROR(returnVal);
+        exit(EXIT_FAILURE);
+    }
+    
+    if(optSt->positionLists) {
+        indexBookBuffer(bkFilSt);
+    }
+    
+    /* The next buffer is read while this one is being mapped to */
+    struct bookReadAheadStruct readAhead;
+    bool readingAhead = useBookReadAhead(bkFilSt, optSt);
+    if (readingAhead) {
+        startBookReadAhead(&readAhead, bkFilSt);
+        requestBookReadAhead(&readAhead, bkFilSt, nextBookBufferPos(bkFilSt, bkFilSt->bkFilPos));
+    }
+    
+    /* The original file is read and the book code written in threads of their own. From here on 
+     * bkCdSt is the mapper's side of the pipeline, which only holds the buffer being filled.
+     */
+    struct mapPipelineStruct pipeline;
+    bool pipelined = useMapPipeline(orgFilSt, bkCdSt, optSt);
+    if (pipelined) {
+        startMapPipeline(&pipeline, orgFilSt, bkCdSt);
+        bkCdSt = &pipeline.mapperBkCdSt;
+    }
+
+    /* Begin mapping the original file to offsets in the book file */
+    size_t bytesRemaining = orgFilSt->orgFilSize;
+    size_t currentChunk = orgFilSt->orgFilBufSize;
+    for (; bytesRemaining; bytesRemaining -= currentChunk) {
+        if(currentChunk > bytesRemaining) {
+            currentChunk = bytesRemaining;
+        }
+
+        size_t chunkStart;
+        if (pipelined) {
+            takeOriginalFileChunk(&pipeline, orgFilSt);
+            chunkStart = orgFilSt->orgFilSize - bytesRemaining;
+        } else {
+            if(freadWErrCheck(orgFilSt->orgFilBuffer, 1, sizeof(byte_t) * currentChunk, orgFilSt->orgFil, &returnVal) !=0 ) {
+                PRINT_SYS_ERROR(returnVal);
+                exit(EXIT_FAILURE);
+            }
+            chunkStart = ftell(orgFilSt->orgFil) - currentChunk;
+        }
+        
+        if(optSt->verbosityLevel >= 2) {
+            fprintf(stderr,"Processing chunk %lu-%lu of original file...\n", (uint64_t)chunkStart, (uint64_t)(chunkStart + currentChunk));
+        }
+
+        orgFilSt->orgFilBufPos = 0;
+
+        while (orgFilSt->orgFilBufPos < currentChunk) {
+
+            orgFilSt->orgFilByte = orgFilSt->orgFilBuffer[orgFilSt->orgFilBufPos];
+            
+            bkFilSt->bkFilBufPos = findNextBookByte(bkFilSt, orgFilSt->orgFilByte, optSt);
+
+            if (bkFilSt->bkFilBufPos < bkFilSt->bkFilBufSize) {
+                
+                bkFilSt->bkFilByte = bkFilSt->bkFilBuffer[bkFilSt->bkFilBufPos];
+
+                oSetSt->byteOffset = bkFilSt->bkFilStart + bkFilSt->bkFilPos + bkFilSt->bkFilBufPos;
+
+                if(optSt->uniqueOffsets) {
+                    /* Keep searching past any offset that has been used before anywhere in the 
+                     * book code
+                     */
+                    if (testAndSetUsedOffset(bkFilSt->bkFilUsedMap, bkFilSt->bkFilPos + bkFilSt->bkFilBufPos)) {
+                        bkFilSt->bkFilBufPos++;
+                        continue;
+                    }
+                    if (bkFilSt->bkFilUnusedBits != NULL) {
+                        clearUnusedPosition(bkFilSt, bkFilSt->bkFilPosListCursor[orgFilSt->orgFilByte]);
+                    }
+                } else if(!optSt->allowDuplicates) {
+                    /* This will check if offset for the book file byte has been previously 
+                     * indexed already in order to prevent repeats.
+                     */
+                    if (oSetSt->offsetDigest[bkFilSt->bkFilByte] == (offset_t)oSetSt->byteOffset) {
+                        
+                        /* If repeatsFound is 2 or over then we cannot avoid a repeat in the 
+                         * buffer and should refill it below
+                         */
+                        if(repeatsFound >= 2) {
+                            goto refillBuffer;
+                        }               
+                                         
+                        /* Have to be sure to start back at the beginning of the buffer if we 
+                         * have reached the end
+                         */
+                        if (bkFilSt->bkFilBufPos == (bkFilSt->bkFilBufSize - 1)) {
+                            bkFilSt->bkFilBufPos = 0;
+                        }
+                        
+                        repeatsFound++;
+                        bkFilSt->bkFilBufPos++;
+                        continue;
+                    }
+                }
+                
+                repeatsFound = 0;
+                refillsWithoutMapping = 0;
+
+                /* This will index the offset for the book file byte found in order to be 
+                 * checked next time around.
+                 */
+                oSetSt->offsetDigest[bkFilSt->bkFilByte] = oSetSt->byteOffset;
+
+                /* Offsets are collected in the book code buffer and only written out once it is 
+                 * full, instead of making a call to fwrite for every byte mapped
+                 */
+                bkCdSt->bkCdBuffer[bkCdSt->bkCdBufPos++] = oSetSt->byteOffset;
+                if(bkCdSt->bkCdBufPos == bkCdBufOffsets) {
+                    if (pipelined) {
+                        queueBookCodeBuffer(&pipeline);
+                    } else {
+                        flushBookCodeBuffer(bkCdSt);
+                    }
+                }
+                
+                if(optSt->verbosityLevel >= 3) {
+                    fprintf(stderr,"Wrote offset %lu\n", (uint64_t)oSetSt->byteOffset);
+                }
+                
+                trackLocality(oSetSt, oSetSt->byteOffset);
+
+                orgFilSt->orgFilBufPos++;
+                
+                /* Slide on to the next window once this one has taken its share of the original */
+                if (optSt->slidingWindow) {
+                    windowWrapped = false;
+                    if (++windowBytesMapped == bytesPerWindow) {
+                        windowWrapped = true;
+                        goto refillBuffer;
+                    }
+                }
+                continue;
+            }
+            
+            refillBuffer:
+            {
+                if (++refillsWithoutMapping > maxRefillsWithoutMapping) {
+                    if (optSt->uniqueOffsets) {
+                        fprintf(stderr,"Every offset of byte value %i in the %s has been used, book code could not be created\n", orgFilSt->orgFilByte, optSt->resetAtEndOfBuf ? "book file buffer" : "book file");
+                    } else {
+                        fprintf(stderr,"Not enough entropy in book file or book buffer, book code could not be created\n");
+                    }
+                    exit(EXIT_FAILURE);
+                }
+                
+                /* Increment the book file position and reset the buffer position */
+                uoffset_t prevBkFilPos = bkFilSt->bkFilPos;
+                if (optSt->slidingWindow && !windowWrapped) {
+                    /* Search the window again from its start before sliding on */
+                    windowWrapped = true;
+                } else {
+                    bkFilSt->bkFilPos += bkFilSt->bkFilBufSize;
+                    windowWrapped = false;
+                    windowBytesMapped = 0;
+                }
+                 
+                /* If we have reached the end of the book file or reset-at-buffer is set */
+                if (bkFilSt->bkFilPos >= (bkFilSt->bkFilSize - 1) || optSt->resetAtEndOfBuf) {
+                    bkFilSt->bkFilPos = 0;
+                }
+                
+                /* The buffer already holds this chunk of the book file if we are starting over at 
+                 * the same place, which is always the case with reset-at-buffer, so it doesn't 
+                 * need to be read or indexed again
+                 */
+                if (bkFilSt->bkFilPos != prevBkFilPos) {
+                    if (readingAhead) {
+                        takeBookReadAhead(&readAhead, bkFilSt);
+                        requestBookReadAhead(&readAhead, bkFilSt, nextBookBufferPos(bkFilSt, bkFilSt->bkFilPos));
+                    } else {
+                        if (bkFilSt->bkFilPos == 0) {
+                            /*Reset to the beginning of the book file to fill the buffer*/
+                            fseeko(bkFilSt->bkFil, bkFilSt->bkFilStart, SEEK_SET);
+                        }
+                        
+                        /* Refill the book file buffer with the next chunk */
+                        if(freadWErrCheck(bkFilSt->bkFilBuffer, 1, sizeof(byte_t) * bkFilSt->bkFilBufSize, bkFilSt->bkFil, &returnVal) != 0) {
+                            PRINT_SYS_ERROR(returnVal);
+                            exit(EXIT_FAILURE);
+                        }
+                    }
+                    
+                    if(optSt->positionLists) {
+                        indexBookBuffer(bkFilSt);
+                    }
+                } else if(optSt->positionLists) {
+                    memcpy(bkFilSt->bkFilPosListCursor, bkFilSt->bkFilPosListStart, sizeof(bkFilSt->bkFilPosListCursor));
+                }
+                
+                /* Searching resumes after the first byte of the new buffer, since the first byte 
+                 * of a refilled buffer has never been used and book codes must stay the same. 
+                 * Book codes with unique offsets are new, so they can use it.
+                 */
+                bkFilSt->bkFilBufPos = optSt->uniqueOffsets ? 0 : 1;
+            }
+        }
+        
+        if (pipelined) {
+            releasePipelineSlot(&pipeline.orgFilRing);
+        }
+    }
+    
+    if (readingAhead) {
+        stopBookReadAhead(&readAhead, bkFilSt);
+    }
+    
+    if (pipelined) {
+        stopMapPipeline(&pipeline);
+    } else {
+        flushBookCodeBuffer(bkCdSt);
+    }
+    
+    finishLocality(oSetSt);
+
+    return 0;
+}
+
+/* Sorts count pairs by offset with an LSD radix sort, one pass per byte of the offset. Passes 
+ * where every offset has the same value in that byte are skipped, which will be most of the high 
+ * bytes for a book code made with a small buffer. Returns whichever of the two arrays ended up 
+ * holding the sorted pairs.
+ */
+struct gatherPairStruct *sortGatherPairs(struct gatherPairStruct *pairs, struct gatherPairStruct *pairsTmp, size_t count)
+{
+    /* Count every digit in one pass over the pairs rather than one pass per digit, since offsets 
+     * are 64 bits wide in memory but usually only use the low few bytes
+     */
+    size_t byteCounts[sizeof(uoffset_t)][256] = {{0}};
+    
+    for (size_t i = 0; i < count; i++) {
+        uoffset_t byteOffset = pairs[i].byteOffset;
+        for (size_t digit = 0; digit < sizeof(uoffset_t); digit++) {
+            byteCounts[digit][(byteOffset >> (digit * CHAR_BIT)) & 0xFF]++;
+        }
+    }
+    
+    for (size_t digit = 0; digit < sizeof(uoffset_t); digit++) {
+        size_t shift = digit * CHAR_BIT;
+        
+        if (byteCounts[digit][(pairs[0].byteOffset >> shift) & 0xFF] == count) {
+            continue;
+        }
+        
+        size_t position = 0;
+        for (int i = 0; i < 256; i++) {
+            size_t byteCount = byteCounts[digit][i];
+            byteCounts[digit][i] = position;
+            position += byteCount;
+        }
+        
+        for (size_t i = 0; i < count; i++) {
+            pairsTmp[byteCounts[digit][(pairs[i].byteOffset >> shift) & 0xFF]++] = pairs[i];
+        }
+        
+        struct gatherPairStruct *swap = pairs;
+        pairs = pairsTmp;
+        pairsTmp = swap;
+    }
+    
+    return pairs;
+}
+
+/* Pairs each of count offsets with its place in the extracted file buffer and sorts them by 
+ * offset, checking that none are past the end of the book file
+ */
+struct gatherPairStruct *sortBookCodeOffsets(struct bookFileStruct *bkFilSt, uoffset_t *offsets, size_t count)
+{
+    for (size_t i = 0; i < count; i++) {
+        bkFilSt->bkFilGatherPairs[i].byteOffset = offsets[i];
+        bkFilSt->bkFilGatherPairs[i].extrFilBufPos = i;
+    }
+    
+    struct gatherPairStruct *sortedPairs = sortGatherPairs(bkFilSt->bkFilGatherPairs, bkFilSt->bkFilGatherPairsTmp, count);
+    
+    if (sortedPairs[count - 1].byteOffset >= bkFilSt->bkFilSize) {
+        fprintf(stderr,"Offset %lu in book code is past the end of the book file\n", (uint64_t)sortedPairs[count - 1].byteOffset);
+        exit(EXIT_FAILURE);
+    }
+    
+    return sortedPairs;
+}
+
+/* Looks up the bytes for count offsets by sorting them first and then sweeping through the book 
+ * file in ascending order, reading a window of bkFilBufSize bytes at a time with pread and 
+ * scattering the bytes back to their places in bytes. The kernel is told to start reading the 
+ * next window that will be needed before the current one is used, so that seeking around a book 
+ * file that does not fit in memory becomes a sequential read.
+ */
+void gatherBookBytes(struct bookFileStruct *bkFilSt, uoffset_t *offsets, byte_t *bytes, size_t count)
+{
+    int bkFilDescriptor = fileno(bkFilSt->bkFil);
+    
+    if (count == 0) {
+        return;
+    }
+    
+    struct gatherPairStruct *sortedPairs = sortBookCodeOffsets(bkFilSt, offsets, count);
+    
+    size_t i = 0;
+    while (i < count) {
+        
+        /* Start each window at the page boundary below the first offset it needs to cover, as long 
+         * as the window is large enough for the offset to still fall inside it
+         */
+        off_t windowStart = sortedPairs[i].byteOffset;
+        if (bkFilSt->bkFilBufSize > 4096) {
+            windowStart -= windowStart % 4096;
+        }
+        
+        size_t windowSize = preadFully(bkFilDescriptor, bkFilSt->bkFilBuffer, bkFilSt->bkFilBufSize, windowStart);
+        off_t windowEnd = windowStart + windowSize;
+        
+        /* Find where the next window will start and have it read ahead while this one is used */
+        size_t nextWindow = i;
+        while (nextWindow < count && (off_t)sortedPairs[nextWindow].byteOffset < windowEnd) {
+            nextWindow++;
+        }
+        
+        if (nextWindow < count) {
+            posix_fadvise(bkFilDescriptor, sortedPairs[nextWindow].byteOffset, bkFilSt->bkFilBufSize, POSIX_FADV_WILLNEED);
+        }
+        
+        for (; i < nextWindow; i++) {
+            bytes[sortedPairs[i].extrFilBufPos] = bkFilSt->bkFilBuffer[sortedPairs[i].byteOffset - windowStart];
+        }
+    }
+}
+
+/* Sets up an io_uring for reading the book file. Returns false if the kernel won't allow it, in 
+ * which case the book file is read the usual way.
+ */
+bool startBookUring(struct bookFileStruct *bkFilSt)
+{
+    bkFilSt->bkFilUring = NULL;
+    
+#ifdef HAVE_IO_URING
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    
+    int ringFd = syscall(__NR_io_uring_setup, IO_URING_QUEUE_DEPTH, &params);
+    if (ringFd < 0) {
+        return false;
+    }
+    
+    struct bookUringStruct *uring = calloc(1, sizeof(struct bookUringStruct));
+    if (uring == NULL) {
+        PRINT_SYS_ERROR(errno);
+        exit(EXIT_FAILURE);
+    }
+    
+    uring->ringFd = ringFd;
+    uring->entries = params.sq_entries;
+    uring->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    uring->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    uring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    
+    /* Newer kernels map both rings at once */
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (uring->cqRingSize > uring->sqRingSize) {
+            uring->sqRingSize = uring->cqRingSize;
+        }
+        uring->cqRingSize = uring->sqRingSize;
+    }
+    
+    uring->sqRing = mmap(NULL, uring->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+    if (uring->sqRing == MAP_FAILED) {
+        PRINT_SYS_ERROR(errno);
+        exit(EXIT_FAILURE);
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        uring->cqRing = uring->sqRing;
+    } else {
+        uring->cqRing = mmap(NULL, uring->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+        if (uring->cqRing == MAP_FAILED) {
+            PRINT_SYS_ERROR(errno);
+            exit(EXIT_FAILURE);
+        }
+    }
+    uring->sqes = mmap(NULL, uring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+    if (uring->sqes == MAP_FAILED) {
+        PRINT_SYS_ERROR(errno);
+        exit(EXIT_FAILURE);
+    }
+    
+    uring->sqTail = (unsigned *)((byte_t *)uring->sqRing + params.sq_off.tail);
+    uring->sqMask = (unsigned *)((byte_t *)uring->sqRing + params.sq_off.ring_mask);
+    uring->sqArray = (unsigned *)((byte_t *)uring->sqRing + params.sq_off.array);
+    uring->cqHead = (unsigned *)((byte_t *)uring->cqRing + params.cq_off.head);
+    uring->cqTail = (unsigned *)((byte_t *)uring->cqRing + params.cq_off.tail);
+    uring->cqMask = (unsigned *)((byte_t *)uring->cqRing + params.cq_off.ring_mask);
+    uring->cqes = (struct io_uring_cqe *)((byte_t *)uring->cqRing + params.cq_off.cqes);
+    
+    /* There is a slot for every submission entry, and the completion ring is at least as large, 
+     * so neither ring can overflow
+     */
+    uring->pages = malloc(uring->entries * IO_URING_PAGE_SIZE);
+    uring->pageStart = malloc(uring->entries * sizeof(off_t));
+    uring->pageFirstPair = malloc(uring->entries * sizeof(size_t));
+    uring->pagePairEnd = malloc(uring->entries * sizeof(size_t));
+    uring->freeSlots = malloc(uring->entries * sizeof(unsigned));
+    if (uring->pages == NULL || uring->pageStart == NULL || uring->pageFirstPair == NULL || uring->pagePairEnd == NULL || uring->freeSlots == NULL) {
+        PRINT_SYS_ERROR(errno);
+        exit(EXIT_FAILURE);
+    }
+    for (unsigned i = 0; i < uring->entries; i++) {
+        uring->freeSlots[i] = i;
+    }
+    uring->freeCount = uring->entries;
+    
+    bkFilSt->bkFilUring = uring;
+    return true;
+#else
+    return false;
+#endif
+}
+
+void stopBookUring(struct bookFileStruct *bkFilSt)
+{
+#ifdef HAVE_IO_URING
+    struct bookUringStruct *uring = bkFilSt->bkFilUring;
+    
+    if (uring == NULL) {
+        return;
+    }
+    
+    munmap(uring->sqes, uring->sqesSize);
+    if (uring->cqRing != uring->sqRing) {
+        munmap(uring->cqRing, uring->cqRingSize);
+    }
+    munmap(uring->sqRing, uring->sqRingSize);
+    close(uring->ringFd);
+    
+    free(uring->pages);
+    free(uring->pageStart);
+    free(uring->pageFirstPair);
+    free(uring->pagePairEnd);
+    free(uring->freeSlots);
+    free(uring);
+    bkFilSt->bkFilUring = NULL;
+#else
+    (void)bkFilSt;
+#endif
+}
+
+#ifdef HAVE_IO_URING
+/* Submits every queued read and waits until at least waitFor of them have completed */
+void enterBookUring(struct bookUringStruct *uring, unsigned waitFor)
+{
+    for (;;) {
+        int submitted = syscall(__NR_io_uring_enter, uring->ringFd, uring->queued, waitFor, waitFor > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (submitted < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            PRINT_SYS_ERROR(errno);
+            exit(EXIT_FAILURE);
+        }
+        uring->queued -= submitted;
+        uring->inFlight += submitted;
+        if (uring->queued == 0) {
+            break;
+        }
+    }
+}
+
+/* Copies the bytes out of every page that has been read and frees its slot */
+void reapBookUring(struct bookFileStruct *bkFilSt)
+{
+    struct bookUringStruct *uring = bkFilSt->bkFilUring;
+    unsigned head = *uring->cqHead;
+    unsigned tail = __atomic_load_n(uring->cqTail, __ATOMIC_ACQUIRE);
+    
+    for (; head != tail; head++) {
+        struct io_uring_cqe *cqe = &uring->cqes[head & *uring->cqMask];
+        unsigned slot = cqe->user_data;
+        
+        if (cqe->res < 0) {
+            PRINT_FILE_ERROR(bkFilSt->bkFilName,-cqe->res);
+            exit(EXIT_FAILURE);
+        }
+        
+        byte_t *page = uring->pages + (size_t)slot * IO_URING_PAGE_SIZE;
+        for (size_t i = uring->pageFirstPair[slot]; i < uring->pagePairEnd[slot]; i++) {
+            size_t pagePos = uring->pairs[i].byteOffset - uring->pageStart[slot];
+            if (pagePos >= (size_t)cqe->res) {
+                PRINT_FILE_ERROR(bkFilSt->bkFilName,EIO);
+                exit(EXIT_FAILURE);
+            }
+            uring->bytes[uring->pairs[i].extrFilBufPos] = page[pagePos];
+        }
+        
+        uring->freeSlots[uring->freeCount++] = slot;
+        uring->inFlight--;
+    }
+    
+    __atomic_store_n(uring->cqHead, head, __ATOMIC_RELEASE);
+}
+#endif
+
+/* Looks up the bytes for count offsets by sorting them and reading each page of the book file 
+ * they fall in with io_uring, keeping as many reads in flight at once as there are slots. Bytes 
+ * are copied to their places in bytes as their pages arrive, in whatever order that is.
+ */
+void uringGatherBookBytes(struct bookFileStruct *bkFilSt, uoffset_t *offsets, byte_t *bytes, size_t count)
+{
+#ifdef HAVE_IO_URING
+    struct bookUringStruct *uring = bkFilSt->bkFilUring;
+    int bkFilDescriptor = fileno(bkFilSt->bkFil);
+    
+    if (count == 0) {
+        return;
+    }
+    
+    uring->pairs = sortBookCodeOffsets(bkFilSt, offsets, count);
+    uring->bytes = bytes;
+    
+    size_t i = 0;
+    while (i < count) {
+        off_t pageStart = uring->pairs[i].byteOffset - uring->pairs[i].byteOffset % IO_URING_PAGE_SIZE;
+        size_t pairEnd = i;
+        while (pairEnd < count && (off_t)uring->pairs[pairEnd].byteOffset < pageStart + IO_URING_PAGE_SIZE) {
+            pairEnd++;
+        }
+        
+        if (uring->freeCount == 0) {
+            enterBookUring(uring, 1);
+            reapBookUring(bkFilSt);
+        }
+        
+        unsigned slot = uring->freeSlots[--uring->freeCount];
+        uring->pageStart[slot] = pageStart;
+        uring->pageFirstPair[slot] = i;
+        uring->pagePairEnd[slot] = pairEnd;
+        
+        unsigned tail = *uring->sqTail;
+        unsigned index = tail & *uring->sqMask;
+        struct io_uring_sqe *sqe = &uring->sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = bkFilDescriptor;
+        sqe->off = pageStart;
+        sqe->addr = (uint64_t)(uintptr_t)(uring->pages + (size_t)slot * IO_URING_PAGE_SIZE);
+        sqe->len = IO_URING_PAGE_SIZE;
+        sqe->user_data = slot;
+        uring->sqArray[index] = index;
+        __atomic_store_n(uring->sqTail, tail + 1, __ATOMIC_RELEASE);
+        uring->queued++;
+        
+        i = pairEnd;
+    }
+    
+    while (uring->queued > 0 || uring->inFlight > 0) {
+        enterBookUring(uring, uring->inFlight + uring->queued);
+        reapBookUring(bkFilSt);
+    }
+#else
+    (void)bkFilSt;
+    (void)offsets;
+    (void)bytes;
+    (void)count;
+#endif
+}
+
+void *mapWorker(void *arg)
+{
+    struct mapWorkerStruct *worker = arg;
+    
+    mapOffsets(&worker->bkFilSt, &worker->bkCdSt, &worker->orgFilSt, &worker->oSetSt, worker->optSt);
+    
+    return NULL;
+}
+
+/* Maps the original file with several threads at once. The original file is cut into one segment 
+ * per thread, and the book file into as many slices, each a multiple of book_file_buffer. Every 
+ * thread maps its segment only to offsets inside its own slice, as if the slice were the whole 
+ * book file, so no two threads can ever hand out the same offset. Each thread writes its part 
+ * of the book code to a temporary file, and these are then written out in order.
+ * 
+ * The first thread uses the buffers and handles already set up in main, and the others get their 
+ * own.
+ */
+void mapOffsetsInParallel(
+struct bookFileStruct *bkFilSt,
+struct bookCodeStruct *bkCdSt, 
+struct originalFileStruct *orgFilSt,
+struct offsetStruct *oSetSt,
+struct optionsStruct *optSt
+)
+{
+    int returnVal = 0;
+    size_t bkFilSliceSize = bkFilSt->bkFilSize / optSt->threadCount;
+    bkFilSliceSize -= bkFilSliceSize % bkFilSt->bkFilBufSize;
+    size_t orgFilSegmentSize = (orgFilSt->orgFilSize + optSt->threadCount - 1) / optSt->threadCount;
+    
+    if (bkFilSliceSize == 0) {
+        fprintf(stderr,"Book file is too small to be split between %i threads with this book_file_buffer\n", optSt->threadCount);
+        exit(EXIT_FAILURE);
+    }
+    
+    struct mapWorkerStruct *workers = calloc(optSt->threadCount, sizeof(struct mapWorkerStruct));
+    if (workers == NULL) {
+        PRINT_SYS_ERROR(errno);
+        exit(EXIT_FAILURE);
+    }
+    
+    for (int i = 0; i < optSt->threadCount; i++) {
+        struct mapWorkerStruct *worker = &workers[i];
+        
+        worker->bkFilSt = *bkFilSt;
+        worker->bkCdSt = *bkCdSt;
+        worker->orgFilSt = *orgFilSt;
+        worker->oSetSt = *oSetSt;
+        worker->optSt = optSt;
+        
+        if (i > 0) {
+            worker->bkFilSt.bkFil = fopen(bkFilSt->bkFilName, "rb");
+            if (worker->bkFilSt.bkFil == NULL) {
+                PRINT_FILE_ERROR(bkFilSt->bkFilName,errno);
+                exit(EXIT_FAILURE);
+            }
+            
+            worker->orgFilSt.orgFil = fopen(orgFilSt->orgFilName, "rb");
+            if (worker->orgFilSt.orgFil == NULL) {
+                PRINT_FILE_ERROR(orgFilSt->orgFilName,errno);
+                exit(EXIT_FAILURE);
+            }
+            
+            worker->bkFilSt.bkFilBuffer = malloc(bkFilSt->bkFilBufSize);
+            worker->orgFilSt.orgFilBuffer = malloc(orgFilSt->orgFilBufSize);
+            worker->bkCdSt.bkCdBuffer = malloc(bkCdSt->bkCdBufSize);
+            worker->bkCdSt.bkCdCodedBuffer = malloc(bkCdSt->bkCdCodedBufSize);
+            if (worker->bkFilSt.bkFilBuffer == NULL || worker->orgFilSt.orgFilBuffer == NULL || worker->bkCdSt.bkCdBuffer == NULL || worker->bkCdSt.bkCdCodedBuffer == NULL) {
+                PRINT_SYS_ERROR(errno);
+                exit(EXIT_FAILURE);
+            }
+            
+            /* Position lists from a book index are shared from the mapped index file */
+            if (optSt->positionLists && !optSt->useIndex) {
+                worker->bkFilSt.bkFilPosList = malloc(bkFilSt->bkFilBufSize * sizeof(uint32_t));
+                if (worker->bkFilSt.bkFilPosList == NULL) {
+                    PRINT_SYS_ERROR(errno);
+                    exit(EXIT_FAILURE);
+                }
+            }
+            
+            /* Offsets in the used offset map are relative to the start of the slice */
+            if (optSt->uniqueOffsets) {
+                allocUsedOffsetMap(&worker->bkFilSt, bkFilSliceSize);
+                if (optSt->positionLists) {
+                    allocUnusedPositions(&worker->bkFilSt);
+                }
+            }
+        }
+        
+        /* The parts are written raw with offsets of the book code's width, which the book file 
+         * has already been cut down to fit, and only encoded once they are put together in order
+         */
+        worker->bkCdSt.bkCdFormat = BOOK_CODE_RAW;
+        worker->bkCdSt.bkCdCompression = BOOK_CODE_UNCOMPRESSED;
+        worker->bkCdSt.bkCdContainer = false;
+        setOffsetWidth(&worker->bkCdSt, bkCdSt->bkCdOffsetWidth);
+        worker->bkCdSt.bkCd = tmpfile();
+        if (worker->bkCdSt.bkCd == NULL) {
+            PRINT_SYS_ERROR(errno);
+            exit(EXIT_FAILURE);
+        }
+        
+        /* Hand this thread its slice of the book file and segment of the original file */
+        worker->bkFilSt.bkFilStart = bkFilSliceSize * i;
+        worker->bkFilSt.bkFilSize = bkFilSliceSize;
+        
+        size_t orgFilSegmentStart = orgFilSegmentSize * i;
+        if (orgFilSegmentStart > orgFilSt->orgFilSize) {
+            orgFilSegmentStart = orgFilSt->orgFilSize;
+        }
+        worker->orgFilSt.orgFilSize = orgFilSt->orgFilSize - orgFilSegmentStart;
+        if (worker->orgFilSt.orgFilSize > orgFilSegmentSize) {
+            worker->orgFilSt.orgFilSize = orgFilSegmentSize;
+        }
+        
+        if (fseeko(worker->bkFilSt.bkFil, worker->bkFilSt.bkFilStart, SEEK_SET) != 0 || fseeko(worker->orgFilSt.orgFil, orgFilSegmentStart, SEEK_SET) != 0) {
+            PRINT_SYS_ERROR(errno);
+            exit(EXIT_FAILURE);
+        }
+        
+        if (optSt->verbosityLevel >= 1) {
+            fprintf(stderr,"Thread %i mapping bytes %lu-%lu of original file to offsets %lu-%lu of book file\n", i, (uint64_t)orgFilSegmentStart, (uint64_t)(orgFilSegmentStart + worker->orgFilSt.orgFilSize), (uint64_t)worker->bkFilSt.bkFilStart, (uint64_t)(worker->bkFilSt.bkFilStart + bkFilSliceSize));
+        }
+        
+        int errCode = pthread_create(&worker->thread, NULL, mapWorker, worker);
+        if (errCode != 0) {
+            PRINT_SYS_ERROR(errCode);
+            exit(EXIT_FAILURE);
+        }
+    }
+    
+    for (int i = 0; i < optSt->threadCount; i++) {
+        pthread_join(workers[i].thread, NULL);
+        oSetSt->localitySpanTotal += workers[i].oSetSt.localitySpanTotal;
+        oSetSt->localityBlocks += workers[i].oSetSt.localityBlocks;
+    }
+    
+    /* Write each thread's part of the book code out in order */
+    size_t bkCdBufOffsets = bkCdSt->bkCdBufSize / sizeof(oSetSt->byteOffset);
+    for (int i = 0; i < optSt->threadCount; i++) {
+        struct mapWorkerStruct *worker = &workers[i];
+        
+        rewind(worker->bkCdSt.bkCd);
+        
+        while ((bkCdSt->bkCdBufPos = fread(bkCdSt->bkCdCodedBuffer, worker->bkCdSt.bkCdOffsetBytes, bkCdBufOffsets, worker->bkCdSt.bkCd)) > 0) {
+            worker->bkCdSt.unpackOffsets(bkCdSt->bkCdCodedBuffer, bkCdSt->bkCdBuffer, bkCdSt->bkCdBufPos);
+            flushBookCodeBuffer(bkCdSt);
+        }
+        
+        if (ferror(worker->bkCdSt.bkCd)) {
+            returnVal = errno;
+            PRINT_SYS_ERROR(returnVal);
+            exit(EXIT_FAILURE);
+        }
+        
+        fclose(worker->bkCdSt.bkCd);
+        
+        if (i > 0) {
+            fclose(worker->bkFilSt.bkFil);
+            fclose(worker->orgFilSt.orgFil);
+            free(worker->bkFilSt.bkFilBuffer);
+            free(worker->orgFilSt.orgFilBuffer);
+            free(worker->bkCdSt.bkCdBuffer);
+            free(worker->bkCdSt.bkCdCodedBuffer);
+            if (!optSt->useIndex) {
+                free(worker->bkFilSt.bkFilPosList);
+            }
+            freeUsedOffsetMap(&worker->bkFilSt);
+            free(worker->bkFilSt.bkFilUnusedBits);
+        }
+    }
+    
+    free(workers);
+}
+
+/* Copies the byte residing at each of count offsets in the book file into bytes */
+void lookUpBookBytes(struct bookFileStruct *bkFilSt, uoffset_t *offsets, byte_t *bytes, size_t count, struct optionsStruct *optSt)
+{
+    if(bkFilSt->bkFilUring != NULL) {
+        uringGatherBookBytes(bkFilSt, offsets, bytes, count);
+        return;
+    }
+    
+    if(optSt->sortedGather) {
+        gatherBookBytes(bkFilSt, offsets, bytes, count);
+        return;
+    }
+    
+    if(bkFilSt->bkFilMap != NULL) {
+        /* The book file is mapped into memory, so each offset can be read directly without a 
+         * seek and read for every byte
+         */
+        for (size_t i = 0; i < count; i++) {
+            if (offsets[i] >= bkFilSt->bkFilSize) {
+                fprintf(stderr,"Offset %lu in book code is past the end of the book file\n", (uint64_t)offsets[i]);
+                exit(EXIT_FAILURE);
+            }
+            
+            bytes[i] = bkFilSt->bkFilMap[offsets[i]];
+        }
+        
+        return;
+    }
+    
+    for (size_t i = 0; i < count; i++) {
+        
+        /* Seek to the offset in the book file */
+        fseek(bkFilSt->bkFil, offsets[i], SEEK_SET);
+        
+        /* Grab the byte residing at that offset in the book file */
+        int bkFilByte = fgetc(bkFilSt->bkFil);
+        if (bkFilByte == EOF) {
+            fprintf(stderr,"Offset %lu in book code is past the end of the book file\n", (uint64_t)offsets[i]);
+            exit(EXIT_FAILURE);
+        }
+        
+        bytes[i] = bkFilByte;
+    }
+}
+
+/* Writes count bytes from buffer at offset with pwrite, retrying short writes */
+void pwriteFully(int fd, byte_t *buffer, size_t count, off_t offset)
+{
+    size_t bytesWritten = 0;
+    
+    while (bytesWritten < count) {
+        ssize_t result = pwrite(fd, buffer + bytesWritten, count - bytesWritten, offset + bytesWritten);
+        if (result == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            PRINT_SYS_ERROR(errno);
+            exit(EXIT_FAILURE);
+        }
+        bytesWritten += result;
+    }
+}
+
+/* Checks extracted bytes of a container, which start at byte pos of the original file, against 
+ * the CRC-32C of each block of the original file in the block index. As with the book code, only 
+ * blocks extracted from their start are checked.
+ */
+void checkExtractedBytes(struct bookCodeStruct *bkCdSt, const byte_t *bytes, size_t count, uint64_t pos)
+{
+    uint64_t blockOffsets = bkCdSt->bkCdContainerHeader.blockOffsets;
+    
+    if (bkCdSt->bkCdBlocks == NULL) {
+        return;
+    }
+    
+    if (pos != bkCdSt->bkCdOrgCheckPos) {
+        bkCdSt->bkCdOrgCheckCrc = 0;
+        bkCdSt->bkCdOrgCheckWhole = pos % blockOffsets == 0;
+    }
+    bkCdSt->bkCdOrgCheckPos = pos + count;
+    
+    while (count > 0) {
+        uint64_t block = pos / blockOffsets;
+        uint64_t blockEnd = (block + 1) * blockOffsets;
+        if (blockEnd > bkCdSt->bkCdContainerHeader.orgFilSize) {
+            blockEnd = bkCdSt->bkCdContainerHeader.orgFilSize;
+        }
+        if (block >= bkCdSt->bkCdBlockCount || pos >= blockEnd) {
+            break;
+        }
+        
+        size_t piece = blockEnd - pos < count ? blockEnd - pos : count;
+        if (bkCdSt->bkCdOrgCheckWhole) {
+            bkCdSt->bkCdOrgCheckCrc = crc32c(bkCdSt->bkCdOrgCheckCrc, bytes, piece);
+        }
+        bytes += piece;
+        pos += piece;
+        count -= piece;
+        
+        if (pos == blockEnd) {
+            if (bkCdSt->bkCdOrgCheckWhole) {
+                if (bkCdSt->bkCdOrgCheckCrc != bkCdSt->bkCdBlocks[block].orgFilCrc) {
+                    fprintf(stderr,"Block %lu of the extracted file doesn't match the checksum of the original file, so the book code or book file is damaged\n", (uint64_t)block);
+                    exit(EXIT_FAILURE);
+                }
+                bkCdSt->bkCdBlocksChecked++;
+            }
+            
+            bkCdSt->bkCdOrgCheckCrc = 0;
+            bkCdSt->bkCdOrgCheckWhole = true;
+        }
+    }
+}
+
+void *extractWorker(void *arg)
+{
+    struct extractWorkerStruct *worker = arg;
+    struct extractPoolStruct *pool = worker->pool;
+    
+    while (1) {
+        pthread_barrier_wait(&pool->chunkReady);
+        
+        if (pool->finished) {
+            break;
+        }
+        
+        /* Split the chunk into even slices, the last of which may be short or empty */
+        size_t sliceSize = (pool->count + pool->workerCount - 1) / pool->workerCount;
+        size_t sliceStart = sliceSize * worker->workerNumber;
+        size_t sliceCount = 0;
+        if (sliceStart < pool->count) {
+            sliceCount = pool->count - sliceStart < sliceSize ? pool->count - sliceStart : sliceSize;
+        }
+        
+        lookUpBookBytes(&worker->bkFilSt, pool->offsets + sliceStart, pool->bytes + sliceStart, sliceCount, worker->optSt);
+        pwriteFully(pool->extrFilDescriptor, pool->bytes + sliceStart, sliceCount, pool->extrFilPos + sliceStart);
+        
+        pthread_barrier_wait(&pool->chunkDone);
+    }
+    
+    return NULL;
+}
+
+/* Gives a worker its own copy of the book file state. Workers share the memory-mapped book file 
+ * if there is one, otherwise each opens its own handle to seek in. With sorted-gather, each 
+ * worker gets its own read window and pairs for the largest slice it can be given.
+ */
+void setUpExtractWorker(struct extractWorkerStruct *worker, struct bookFileStruct *bkFilSt, size_t sliceSize, struct optionsStruct *optSt)
+{
+    worker->optSt = optSt;
+    worker->bkFilSt = *bkFilSt;
+    
+    if (bkFilSt->bkFilMap == NULL && !optSt->sortedGather) {
+        worker->bkFilSt.bkFil = fopen(bkFilSt->bkFilName, "rb");
+        if (worker->bkFilSt.bkFil == NULL) {
+            PRINT_FILE_ERROR(bkFilSt->bkFilName,errno);
+            exit(EXIT_FAILURE);
+        }
+    }
+    
+    if (optSt->sortedGather) {
+        worker->bkFilSt.bkFilBuffer = malloc(bkFilSt->bkFilBufSize);
+        if (worker->bkFilSt.bkFilBuffer == NULL) {
+            PRINT_SYS_ERROR(errno);
+            exit(EXIT_FAILURE);
+        }
+    }
+    
+    if (optSt->sortedGather || bkFilSt->bkFilUring != NULL) {
+        worker->bkFilSt.bkFilGatherPairs = malloc(sliceSize * sizeof(struct gatherPairStruct));
+        worker->bkFilSt.bkFilGatherPairsTmp = malloc(sliceSize * sizeof(struct gatherPairStruct));
+        if (worker->bkFilSt.bkFilGatherPairs == NULL || worker->bkFilSt.bkFilGatherPairsTmp == NULL) {
+            PRINT_SYS_ERROR(errno);
+            exit(EXIT_FAILURE);
+        }
+    }
+    
+    /* Each worker needs an io_uring of its own, since the rings aren't safe to share */
+    if (bkFilSt->bkFilUring != NULL && !startBookUring(&worker->bkFilSt)) {
+        PRINT_SYS_ERROR(errno);
+        exit(EXIT_FAILURE);
+    }
+}
+
+void tearDownExtractWorker(struct extractWorkerStruct *worker, struct bookFileStruct *bkFilSt, struct optionsStruct *optSt)
+{
+    if (worker->bkFilSt.bkFil != bkFilSt->bkFil) {
+        fclose(worker->bkFilSt.bkFil);
+    }
+    
+    if (optSt->sortedGather) {
+        free(worker->bkFilSt.bkFilBuffer);
+    }
+    if (optSt->sortedGather || bkFilSt->bkFilUring != NULL) {
+        free(worker->bkFilSt.bkFilGatherPairs);
+        free(worker->bkFilSt.bkFilGatherPairsTmp);
+    }
+    stopBookUring(&worker->bkFilSt);
+}
+
+void startExtractWorkers(
+struct extractPoolStruct *pool,
+struct extractWorkerStruct *workers,
+struct bookFileStruct *bkFilSt,
+struct bookCodeStruct *bkCdSt,
+struct extractedFileStruct *extrFilSt,
+struct optionsStruct *optSt
+)
+{
+    size_t sliceSize = (bkCdSt->bkCdBufSize / sizeof(uoffset_t) + optSt->threadCount - 1) / optSt->threadCount;
+    
+    pool->workerCount = optSt->threadCount;
+    pool->extrFilDescriptor = fileno(extrFilSt->extrFil);
+    pool->finished = false;
+    pthread_barrier_init(&pool->chunkReady, NULL, optSt->threadCount + 1);
+    pthread_barrier_init(&pool->chunkDone, NULL, optSt->threadCount + 1);
+    
+    for (int i = 0; i < optSt->threadCount; i++) {
+        workers[i].workerNumber = i;
+        workers[i].pool = pool;
+        setUpExtractWorker(&workers[i], bkFilSt, sliceSize, optSt);
+        
+        int errCode = pthread_create(&workers[i].thread, NULL, extractWorker, &workers[i]);
+        if (errCode != 0) {
+            PRINT_SYS_ERROR(errCode);
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+void stopExtractWorkers(struct extractPoolStruct *pool, struct extractWorkerStruct *workers, struct bookFileStruct *bkFilSt, struct optionsStruct *optSt)
+{
+    pool->finished = true;
+    pthread_barrier_wait(&pool->chunkReady);
+    
+    for (int i = 0; i < optSt->threadCount; i++) {
+        pthread_join(workers[i].thread, NULL);
+        tearDownExtractWorker(&workers[i], bkFilSt, optSt);
+    }
+    
+    pthread_barrier_destroy(&pool->chunkReady);
+    pthread_barrier_destroy(&pool->chunkDone);
+}
+
+/* Decodes and extracts whole blocks of a container, each time taking the next block that no other 
+ * worker has taken yet, so that decoding is spread over the workers as well as looking up
+ */
+void *extractBlockWorker(void *arg)
+{
+    struct extractWorkerStruct *worker = arg;
+    struct extractPoolStruct *pool = worker->pool;
+    struct bookCodeStruct *bkCdSt = &worker->bkCdSt;
+    uint64_t blockNumber;
+    
+    while ((blockNumber = atomic_fetch_add(&pool->nextBlock, 1)) < pool->blockEnd) {
+        seekBookCodeBlock(bkCdSt, blockNumber, blockNumber);
+        
+        uint64_t blockStart = bkCdSt->bkCdOffsetCount;
+        size_t count = readBookCodeOffsets(bkCdSt);
+        
+        /* Only the part of the block within the range is looked up */
+        uint64_t first = blockStart > pool->rangeStart ? blockStart : pool->rangeStart;
+        uint64_t last = blockStart + count < pool->rangeEnd ? blockStart + count : pool->rangeEnd;
+        
+        if(worker->optSt->verbosityLevel >= 2) {
+            fprintf(stderr,"Processing block %lu, bytes %lu-%lu of original file...\n", (uint64_t)blockNumber, (uint64_t)first, (uint64_t)last);
+        }
+        
+        lookUpBookBytes(&worker->bkFilSt, bkCdSt->bkCdBuffer + (first - blockStart), worker->bytes, last - first, worker->optSt);
+        checkExtractedBytes(bkCdSt, worker->bytes, last - first, first);
+        pwriteFully(pool->extrFilDescriptor, worker->bytes, last - first, first - pool->rangeStart);
+    }
+    
+    return NULL;
+}
+
+/* Extracts a container with every worker decoding its own blocks, which it can since each block 
+ * is decoded on its own. Each worker opens the book code itself to read its blocks from.
+ */
+void extractBlocksInParallel(
+struct bookFileStruct *bkFilSt,
+struct bookCodeStruct *bkCdSt, 
+struct extractedFileStruct *extrFilSt,
+struct optionsStruct *optSt
+)
+{
+    struct extractPoolStruct pool;
+    uint64_t blockOffsets = bkCdSt->bkCdContainerHeader.blockOffsets;
+    uint64_t orgFilSize = bkCdSt->bkCdContainerHeader.orgFilSize;
+    
+    pool.rangeStart = optSt->rangeGiven && optSt->rangeStart < orgFilSize ? optSt->rangeStart : (optSt->rangeGiven ? orgFilSize : 0);
+    pool.rangeEnd = orgFilSize;
+    if (optSt->rangeGiven && optSt->rangeLength < orgFilSize - pool.rangeStart) {
+        pool.rangeEnd = pool.rangeStart + optSt->rangeLength;
+    }
+    atomic_init(&pool.nextBlock, pool.rangeStart / blockOffsets);
+    pool.blockEnd = (pool.rangeEnd + blockOffsets - 1) / blockOffsets;
+    pool.extrFilDescriptor = fileno(extrFilSt->extrFil);
+    
+    struct extractWorkerStruct *workers = calloc(optSt->threadCount, sizeof(struct extractWorkerStruct));
+    if (workers == NULL) {
+        PRINT_SYS_ERROR(errno);
+        exit(EXIT_FAILURE);
+    }
+    
+    for (int i = 0; i < optSt->threadCount; i++) {
+        struct extractWorkerStruct *worker = &workers[i];
+        
+        worker->workerNumber = i;
+        worker->pool = &pool;
+        setUpExtractWorker(worker, bkFilSt, blockOffsets, optSt);
+        
+        worker->bkCdSt = *bkCdSt;
+        worker->bkCdSt.bkCdBlocksChecked = 0;
+        worker->bkCdSt.bkCd = fopen(bkCdSt->bkCdFilName, "rb");
+        if (worker->bkCdSt.bkCd == NULL) {
+            PRINT_FILE_ERROR(bkCdSt->bkCdFilName,errno);
+            exit(EXIT_FAILURE);
+        }
+        
+        worker->bkCdSt.bkCdBufSize = blockOffsets * sizeof(uoffset_t);
+        worker->bkCdSt.bkCdCodedBufSize = worker->bkCdSt.bkCdBufSize;
+        worker->bkCdSt.bkCdBuffer = malloc(worker->bkCdSt.bkCdBufSize);
+        worker->bkCdSt.bkCdCodedBuffer = malloc(worker->bkCdSt.bkCdCodedBufSize);
+        worker->bytes = malloc(blockOffsets);
+        if (worker->bkCdSt.bkCdBuffer == NULL || worker->bkCdSt.bkCdCodedBuffer == NULL || worker->bytes == NULL) {
+            PRINT_SYS_ERROR(errno);
+            exit(EXIT_FAILURE);
+        }
+        
+        if (bkCdSt->bkCdCompression != BOOK_CODE_UNCOMPRESSED) {
+            startBookCodeCompression(&worker->bkCdSt, 0, 1, true);
+        }
+        
+        int errCode = pthread_create(&worker->thread, NULL, extractBlockWorker, worker);
+        if (errCode != 0) {
+            PRINT_SYS_ERROR(errCode);
+            exit(EXIT_FAILURE);
+        }
+    }
+    
+    for (int i = 0; i < optSt->threadCount; i++) {
+        struct extractWorkerStruct *worker = &workers[i];
+        
+        pthread_join(worker->thread, NULL);
+        tearDownExtractWorker(worker, bkFilSt, optSt);
+        bkCdSt->bkCdBlocksChecked += worker->bkCdSt.bkCdBlocksChecked;
+        
+        fclose(worker->bkCdSt.bkCd);
+        free(worker->bkCdSt.bkCdBuffer);
+        free(worker->bkCdSt.bkCdCodedBuffer);
+        free(worker->bytes);
+        if (bkCdSt->bkCdCompression != BOOK_CODE_UNCOMPRESSED) {
+            stopBookCodeCompression(&worker->bkCdSt);
+        }
+    }
+    
+    free(workers);
+    
+    if(optSt->rangeGiven && optSt->rangeLength != UINT64_MAX && optSt->rangeLength > pool.rangeEnd - pool.rangeStart) {
+        fprintf(stderr,"The book code ends before the end of the range, so only %lu bytes were extracted\n", (uint64_t)(pool.rangeEnd - pool.rangeStart));
+    }
+}
+
+int extractBytes(
+struct bookFileStruct *bkFilSt,
+struct bookCodeStruct *bkCdSt, 
+struct extractedFileStruct *extrFilSt,
+struct optionsStruct *optSt
+)
+{
+    int returnVal = 0;
+    
+    off_t extrFilPos = 0;
+    
+    struct extractPoolStruct pool;
+    struct extractWorkerStruct *workers = NULL;
+    
+    /* The blocks of a container that can be seeked in are shared out between the workers whole */
+    if(optSt->threadCount > 1 && bkCdSt->bkCdBlocks != NULL) {
+        extractBlocksInParallel(bkFilSt, bkCdSt, extrFilSt, optSt);
+        return 0;
+    }
+    
+    if(optSt->threadCount > 1) {
+        workers = calloc(optSt->threadCount, sizeof(struct extractWorkerStruct));
+        if (workers == NULL) {
+            PRINT_SYS_ERROR(errno);
+            exit(EXIT_FAILURE);
+        }
+        
+        startExtractWorkers(&pool, workers, bkFilSt, bkCdSt, extrFilSt, optSt);
+    }
+    
+    /* Only the offsets of a range are looked up, with any before it that are still to be read 
+     * skipped over
+     */
+    uint64_t rangeSkip = optSt->rangeGiven ? seekBookCodeRange(bkCdSt, optSt) : 0;
+    uint64_t rangeLeft = optSt->rangeGiven ? optSt->rangeLength : UINT64_MAX;
+    size_t offsetCount;
+    
+    /* Each offset read from the book code represents 1 byte of the original file, so the number 
+     * of offsets read is also the number of bytes in the extracted file buffer
+     */
+    while (rangeLeft > 0 && (offsetCount = readBookCodeOffsets(bkCdSt)) > 0) {
+        
+        uoffset_t *offsets = bkCdSt->bkCdBuffer;
+        if (rangeSkip > 0) {
+            size_t skipped = rangeSkip < offsetCount ? rangeSkip : offsetCount;
+            offsets += skipped;
+            offsetCount -= skipped;
+            rangeSkip -= skipped;
+        }
+        if (offsetCount > rangeLeft) {
+            offsetCount = rangeLeft;
+        }
+        if (offsetCount == 0) {
+            continue;
+        }
+        rangeLeft -= offsetCount;
+        extrFilSt->extrFilBufPos = offsetCount;
+        
+        if(optSt->verbosityLevel >= 2) {
+            fprintf(stderr,"Processing chunk %lu-%lu of original file...\n", (uint64_t)(optSt->rangeStart + extrFilPos), (uint64_t)(optSt->rangeStart + extrFilPos + extrFilSt->extrFilBufPos));
+        }    
+        
+        if(optSt->threadCount > 1) {
+            /* The workers write their slices of the extracted file themselves */
+            pool.offsets = offsets;
+            pool.bytes = extrFilSt->extrFilBuffer;
+            pool.count = extrFilSt->extrFilBufPos;
+            pool.extrFilPos = extrFilPos;
+            pthread_barrier_wait(&pool.chunkReady);
+            pthread_barrier_wait(&pool.chunkDone);
+        } else {
+            lookUpBookBytes(bkFilSt, offsets, extrFilSt->extrFilBuffer, extrFilSt->extrFilBufPos, optSt);
+        }
+        
+        checkExtractedBytes(bkCdSt, extrFilSt->extrFilBuffer, extrFilSt->extrFilBufPos, (optSt->rangeGiven ? optSt->rangeStart : 0) + extrFilPos);
+        
+        if(optSt->verbosityLevel >= 3) {
+            for (size_t i = 0; i < extrFilSt->extrFilBufPos; i++) {
+                fprintf(stderr,"Extracted byte at offset %lu\n", (uint64_t)offsets[i]);
+            }
+        }    
+
+        if(optSt->threadCount <= 1 && fwriteWErrCheck(extrFilSt->extrFilBuffer, 1, extrFilSt->extrFilBufPos, extrFilSt->extrFil, &returnVal) != 0) {
+            PRINT_SYS_ERROR(returnVal);
+            exit(EXIT_FAILURE);
+        }
+        
+        extrFilPos += extrFilSt->extrFilBufPos;
+    }
+    
+    if(optSt->threadCount > 1) {
+        stopExtractWorkers(&pool, workers, bkFilSt, optSt);
+        free(workers);
+    }
+    
+    /* The last block of a range is only checked once all of it has been read */
+    if(optSt->rangeGiven && bkCdSt->bkCdBlocks != NULL) {
+        finishBookCodeBlock(bkCdSt);
+    }
+    
+    if(optSt->rangeGiven && rangeLeft > 0 && optSt->rangeLength != UINT64_MAX) {
+        fprintf(stderr,"The book code ends before the end of the range, so only %lu bytes were extracted\n", (uint64_t)extrFilPos);
+    }
+    
+    return 0;
+}
+
+void printHelp(char *argv) {
     fprintf(stderr, 
-"Syntax:\n%s -m | -e -b 'book file' [-c 'book code'] | -o 'original file' [-f 'output file'] [-p] [-r] [-d] [-s] [-v]\n\
+"Syntax:\n%s -m | -e | -I | -A -b 'book file' [-c 'book code'] | -o 'original file' [-f 'output file'] [-p] [-r] [-W] [-d] [-u] [-l] [-i 'index'] [-C] [-R 'start:len'] [-V] [-g] [-U] [-t] [-F] [-w] [-z] [-s] [-v]\n\
 \nOptions:\
 \n\t-m,--map - Map bytes of of original file into book code\
 \n\t\t-b,--book-file 'book file'\n\
@@ -411,25 +3831,75 @@ void printHelp(char *argv) {
 \n\t\t-p,--stdio - Pipe book code to standard output instead of to file.\n\
 \n\t\t-r,--reset-at-buffer - Reset and begin reading at the beginning of the book file when the end of the buffer is reached. This can help reduce file size after compression.\
 \n\t\t Note: The 'book_file_buffer' buffer may not have enough entropy to avoid repeats and duplicates. You can increase its size with -s.\n\
+\n\t\t-W,--sliding-window 'size' - Use a book_file_buffer of this size as a window that slides along the book file with the original file, so each part of the original file is mapped within one window instead of wherever the buffer happens to have wrapped around to.\
+\n\t\t Note: Keeps the offsets of each part of the original file close together in the book file, which makes extraction touch fewer pages of it. The locality reached is reported once the book code is created.\n\
 \n\t\t-d,--duplicates - Allows using duplicate/repeat offsets.\n\
+\n\t\t-u,--unique-offsets - Never use the same offset twice anywhere in the book code, instead of only avoiding repeats of the last offset used for each byte value.\
+\n\t\t Note: Keeps a bitmap with a bit for every byte of the book file. Mapping fails once every offset of a byte value has been used, so it can need a larger book file or buffer.\n\
+\n\t\t-t,--threads 'n' - Split the original file into n segments and the book file into n slices, and map each segment to its own slice in its own thread.\
+\n\t\t Note: Each slice works like a whole book file would without -t, so it needs to have enough entropy on its own. The book code will differ from one mapped with a different number of threads.\n\
+\n\t\t-F,--format 'format' - Format to write the book code in.\
+\n\t\t\t raw\
+\n\t\t\t\t Each offset as an integer of the offset width, with no header if it is 32 bits. This is the default.\
+\n\t\t\t varint\
+\n\t\t\t\t Each offset as the difference from the one before it, in as few bytes as it fits in, after a header identifying the format.\n\
+\n\t\t-w,--offset-width 'bits' - Write raw offsets as 32, 40, 48 or 64-bit integers. Defaults to 32.\
+\n\t\t Note: Only the first 2^bits bytes of the book file can be used, so book files over 4 gigabytes need a wider offset to be used fully.\n\
+\n\t\t-z,--compress 'level' - Compress the book code with xz at a level from 0 to 9, using as many threads as -t or every core otherwise.\
+\n\t\t Note: Raw offsets are shuffled so that the same byte of every offset is grouped together before compressing, which makes them compress much better.\n\
+\n\t\t-C,--container - Write the book code as a container, which records the sizes and hashes of the original and book files in its header, and is written in blocks of 1048576 offsets that are each decoded on their own, with an index of the blocks at the end.\
+\n\t\t Note: Ranges can be extracted from a container with -R without decoding everything before them, and -t decodes its blocks in parallel. Each block is checked against a CRC-32C of its bytes and of the bytes of the original file it holds as it is extracted. A compressed container is written as a new xz stream for every block, which makes it slightly larger.\n\
+\n\t\t-l,--position-lists - Only with -r: index the positions of every byte value in the book file buffer once when it is loaded, and look up byte values that are rare in it, more than 4096 bytes apart on average, in their lists instead of scanning the buffer for them.\
+\n\t\t Note: Uses 4 times as much memory as 'book_file_buffer'. Only speeds up book files where some byte values are rare; otherwise it costs the time to index the buffer once. Has no effect without -r, which loads and would have to index a new buffer every time a byte isn't found.\
+\n\t\t With -u, every byte value is looked up in its list, and a tree of bits over the lists marks which positions are unused, so used offsets are skipped without being looked at. The tree adds an eighth of 'book_file_buffer' to the memory used.\n\
+\n\t\t-i,--index 'index' - Load the position lists of the book file buffer from a book index made with -I instead of building them, which implies -l.\
+\n\t\t Note: book_file_buffer is taken from the index, and -t must be the same as it was built with. The buffer is checked against its hash in the index as it is loaded. Like -l it only applies with -r, and it only saves the time -l takes to build the lists, so it is only faster than scanning where -l is.\n\
+\n\t\t-a,--read-ahead - Read the next book_file_buffer in a background thread while the current one is searched, so mapping only waits on the read if the search finishes first.\
+\n\t\t Note: Uses twice as much memory for 'book_file_buffer'. Done anyway when the book file is larger than the memory available, because then it can't be in the page cache and every buffer has to come from the drive. Has no effect with -r or a book_file_buffer under 256k.\n\
+\n\t\t-P,--pipeline - Read the original file and write out the book code in two more threads while the search runs, handing buffers between them.\
+\n\t\t Note: Uses three times as much memory for 'original_file_buffer' and 'book_code_buffer'. Only worth it when the book code goes to a slow drive or is piped into a compressor, or the original file comes from a slow drive; otherwise it makes mapping slower. Has no effect with -t or buffers under 256k.\n\
 \n\t\t-s,--bufer-size - Comma separated list of buffer sizes. Suffix with 'b' for bytes, 'k' for kilobytes, or 'm' for megabytes. Defaults to 1m.\
 \n\t\t\t book_file_buffer=num[b|k|m]\
 \n\t\t\t\t Controls what size chunk of the book file will be loaded into memory at a time.\
 \n\t\t\t\t Note: If set too low, the buffer may not have enough entropy to avoid repeats and duplicates if -r is also set.\n\
 \n\t\t\t original_file_buffer=num[b|k|m]\
-\n\t\t\t\t Controls what size chunk of the original file will be loaded into memory at a time\n\
+\n\t\t\t\t Controls what size chunk of the original file will be loaded into memory at a time\
+\n\t\t\t book_code_buffer=num[b|k|m]\
+\n\t\t\t\t Controls how much of the book code will be held in memory before writing it out, counted in offsets of the width set with -w\n\
 \n\t\t-v,--verbosity-level 'n' - Sets verbosity level to 1, 2, or 3. (Notice, Info, Debug)\n\
 \n\t-e,--extract - Extract bytes of original file from book code\
 \n\t\t-b,--book-file 'book file'\n\
 \n\t\t-c,--book-code 'book code'\n\
 \n\t\t-p,--stdio - Pipe book code in from standard input instead of from file.\n\
 \n\t\t-f,--output-file 'output file'\n\
+\n\t\t-R,--range 'start:len' - Only extract len bytes of the original file starting from byte start, or everything from start if len is left out. Both can be suffixed with 'b', 'k' or 'm'.\
+\n\t\t Note: Containers are read from the start of the block holding start to the end of the block holding the last byte, so every block the range touches is checked. Other raw book codes are seeked straight to the start, and other varint and compressed book codes are read through from the beginning.\n\
+\n\t\t-V,--no-verify - Don't check the book file against the hash recorded in the book code's header before extracting, or the extracted file against the hash of the original file afterwards when its blocks couldn't all be checked as they were extracted, such as when reading the book code from standard input.\
+\n\t\t Note: Checking hashes the whole book file, so it can be worth skipping when extracting a small range from a large book file that is known to be right.\n\
+\n\t\t-g,--sorted-gather - Sort the offsets of each book code buffer and read the book file in ascending order instead of seeking to each offset.\
+\n\t\t Note: Use this when the book file is too large to fit in memory, so reading it becomes sequential instead of random.\n\
+\n\t\t-U,--io-uring - Read the pages of the book file that each book code buffer needs with io_uring, with up to 128 reads in flight at once. Only on Linux.\
+\n\t\t Note: Use this when the book file is too large to fit in memory and is on a drive that can serve many random reads at once, such as an NVMe SSD.\n\
+\n\t\t-t,--threads 'n' - Split each book code buffer between n threads that look up and write out their part of the extracted file at the same time.\n\
 \n\t\t-s,--buffer-size - Comma separated list of buffer sizes. Suffix with 'b' for bytes, 'k' for kilobytes, or 'm' for megabytes. Defaults to 1m.\
 \n\t\t\t book_code_buffer=num[b|k|m]\
-\n\t\t\t\t Controls what size chunk of the book code will be loaded into memory at a time\
+\n\t\t\t\t Controls what size chunk of the book code will be loaded into memory at a time, counted in offsets of the width it was written with\
 \n\t\t\t extracted_file_buffer=num[b|k|m]\
-\n\t\t\t\t Controls what size chunk of the extracted file will be held in memory before writing to disk\n\
+\n\t\t\t\t Controls what size chunk of the extracted file will be held in memory before writing to disk\
+\n\t\t\t book_file_buffer=num[b|k|m]\
+\n\t\t\t\t Controls what size chunk of the book file will be read at a time with -g\n\
 \n\t\t-v,--verbosity-level 'n' - Sets verbosity level to 1, 2, or 3. (Notice, Info, Debug)\n\
+\n\t-I,--build-index - Build an index of the position lists of the book file buffers that mapping with -r loads, to be used when mapping with -i\
+\n\t\t-b,--book-file 'book file'\n\
+\n\t\t-f,--output-file 'index file' - Defaults to the name of the book file followed by '.index'.\n\
+\n\t\t-s,--buffer-size book_file_buffer=num[b|k|m] - Size of the buffers the book file is indexed in, which must also be used when mapping. Defaults to 1m.\n\
+\n\t\t-t,--threads 'n' - Index the first buffer of each of the n slices that mapping with -t n splits the book file into, instead of just the first buffer of the book file. Also hashes the book file with n threads.\n\
+\n\t\t-v,--verbosity-level 'n' - Sets verbosity level to 1, 2, or 3. (Notice, Info, Debug)\n\
+\n\t-A,--analyze - Report the entropy and byte values of a book file and of each book_file_buffer of it\
+\n\t\t-b,--book-file 'book file'\n\
+\n\t\t-o,--original-file 'original file' - Also report whether the original file can be mapped to the book file, and the smallest book_file_buffer to map it with -r and with -r -u.\n\
+\n\t\t-s,--buffer-size book_file_buffer=num[b|k|m] - Size of the windows of the book file to report on. Defaults to 1m.\n\
+\n\t\t-v,--verbosity-level 'n' - At 2 or more, report on every window.\n\
 \nExamples:\
 \nMap a book code from an original file named 'orginal_file' using a book file named 'book_file' and write to a file named 'book code' using 512 kilobyte buffers\
 \n\tbookcoder -m -b book_file -o original_file -f book_code -s original_file_buffer=512k,book_file_buffer=512k\
@@ -449,7 +3919,6 @@ struct bookFileStruct *bkFilSt,
 struct bookCodeStruct *bkCdSt,
 struct originalFileStruct *orgFilSt,
 struct extractedFileStruct *extrFilSt,
-struct offsetStruct *oSetSt,
 struct optionsStruct *optSt
 ) {
     int c;
@@ -471,12 +3940,29 @@ struct optionsStruct *optSt
             {"verbose",           required_argument, 0,'v' },
             {"help",              no_argument,       0,'h' },
             {"duplicates",        no_argument,       0,'d' },
+            {"unique-offsets",    no_argument,       0,'u' },
             {"stdio",             no_argument,       0,'p' },
             {"reset-after-buffer",no_argument,       0,'r' },
+            {"position-lists",    no_argument,       0,'l' },
+            {"sorted-gather",     no_argument,       0,'g' },
+            {"io-uring",          no_argument,       0,'U' },
+            {"read-ahead",        no_argument,       0,'a' },
+            {"pipeline",          no_argument,       0,'P' },
+            {"threads",           required_argument, 0,'t' },
+            {"format",            required_argument, 0,'F' },
+            {"compress",          required_argument, 0,'z' },
+            {"offset-width",      required_argument, 0,'w' },
+            {"build-index",       no_argument,       0,'I' },
+            {"index",             required_argument, 0,'i' },
+            {"analyze",           no_argument,       0,'A' },
+            {"sliding-window",    required_argument, 0,'W' },
+            {"container",         no_argument,       0,'C' },
+            {"range",             required_argument, 0,'R' },
+            {"no-verify",         no_argument,       0,'V' },
             {0,                0,                 0, 0  }
         };
         
-        c = getopt_long(argc, argv, "meb:c:o:f:s:v:hpr",
+        c = getopt_long(argc, argv, "meIAb:c:o:f:s:v:hdprulgUaPCVt:F:z:w:i:W:R:",
                         long_options, &option_index);
        if (c == -1)
            break;
@@ -489,6 +3975,27 @@ struct optionsStruct *optSt
         case 'e':
             optSt->extractBytes = true;
         break;
+        case 'I':
+            optSt->buildIndex = true;
+        break;
+        case 'A':
+            optSt->analyzeBook = true;
+        break;
+        case 'i':
+            if (optarg[0] == '-' && strlen(optarg) == 2) {
+                fprintf(stderr, "Option -i requires an argument\n");
+                errflg++;
+                break;
+            } else {
+                optSt->useIndex = true;
+                optSt->positionLists = true;
+                snprintf(bkFilSt->bkFilIndexName, NAME_MAX, "%s", optarg);
+            }
+            
+            if (optSt->extractBytes) {
+                fprintf(stderr,"A book index is only used when mapping, so -i will have no effect\n");
+            }
+        break;
         case 'b':
             if (optarg[0] == '-' && strlen(optarg) == 2) {
                 fprintf(stderr, "Option -b requires an argument\n");
@@ -533,6 +4040,10 @@ struct optionsStruct *optSt
                     optSt->outputFileGiven = true;
                     snprintf(extrFilSt->extrFilName, NAME_MAX, "%s", optarg);
                 }
+                else if(optSt->buildIndex == true) {
+                    optSt->outputFileGiven = true;
+                    snprintf(bkFilSt->bkFilIndexName, NAME_MAX, "%s", optarg);
+                }
             }
         break;
         case 's':
@@ -583,10 +4094,6 @@ struct optionsStruct *optSt
                             continue;
                         }
                         
-                        if(!optSt->mapOffsets) {
-                            fprintf(stderr,"book_file_buffer will have no effect when extracting bytes\n");
-                        }
-                            
                         optSt->bkFilBufSizeGiven = true;
                         bkFilSt->bkFilBufSize = atol(value) * sizeof(byte_t) * getBufSizeMultiple(value);
                     break;
@@ -598,15 +4105,12 @@ struct optionsStruct *optSt
                             continue;
                         }
                         
-                        if(!optSt->extractBytes) {
-                            fprintf(stderr,"book_code_buffer will have no effect when mapping offsets\n");
-                        }
-
                         optSt->bkCdBufSizeGiven = true;
                         
-                        /*Divide the amount specified by the size of the byte offste since it will 
-                         * be multipled later*/
-                        bkCdSt->bkCdBufSize = (atol(value) * getBufSizeMultiple(value)) / sizeof(oSetSt->byteOffset);
+                        /* The amount specified is of book code as it is written, so it is only 
+                         * turned into a number of offsets once the offset width is known
+                         */
+                        bkCdSt->bkCdBufSize = atol(value) * getBufSizeMultiple(value);
                     break;
                     case EXTR_FILE_BUFFER:
                         if (value == NULL) {
@@ -630,32 +4134,175 @@ struct optionsStruct *optSt
                 }
             }
         break;
-        case 'v':
-            if (optarg[0] == '-' && strlen(optarg) == 2) {
-                optSt->verbosityLevel = 1;
-            } else {
-                optSt->verbosityLevel = atoi(optarg);
+        case 'v':
+            if (optarg[0] == '-' && strlen(optarg) == 2) {
+                optSt->verbosityLevel = 1;
+            } else {
+                optSt->verbosityLevel = atoi(optarg);
+            }
+        break;
+        case 'h':
+            printHelp(binName);
+            exit(EXIT_SUCCESS);
+        break;
+        case 'd':
+            optSt->allowDuplicates = true;
+        break;
+        case 'u':
+            optSt->uniqueOffsets = true;
+        break;
+        case 'p':
+            if(optSt->mapOffsets) {
+                optSt->writeToStdout = true;
+                optSt->outputFileGiven = true;
+            }
+            else if(optSt->extractBytes) {
+                optSt->readFromStdin = true;
+                optSt->bkCdGiven = true;
+            }
+        break;
+        case 'r':
+            optSt->resetAtEndOfBuf = true;
+        break;
+        case 'l':
+            optSt->positionLists = true;
+        break;
+        case 'g':
+            optSt->sortedGather = true;
+        break;
+        case 'U':
+#ifdef HAVE_IO_URING
+            optSt->ioUring = true;
+#else
+            fprintf(stderr, "-U is only available on Linux systems with io_uring\n");
+            errflg++;
+#endif
+        break;
+        case 'a':
+            optSt->readAhead = true;
+            
+            if (optSt->extractBytes) {
+                fprintf(stderr,"Reading ahead only applies when mapping, so -a will have no effect\n");
+            }
+        break;
+        case 'P':
+            optSt->pipeline = true;
+            
+            if (optSt->extractBytes) {
+                fprintf(stderr,"The pipeline only applies when mapping, so -P will have no effect\n");
+            }
+        break;
+        case 'F':
+            if (optarg[0] == '-' && strlen(optarg) == 2) {
+                fprintf(stderr, "Option -F requires an argument\n");
+                errflg++;
+                break;
+            } else if (strcmp(optarg, bookCodeFormatName(BOOK_CODE_RAW)) == 0) {
+                bkCdSt->bkCdFormat = BOOK_CODE_RAW;
+            } else if (strcmp(optarg, bookCodeFormatName(BOOK_CODE_VARINT)) == 0) {
+                bkCdSt->bkCdFormat = BOOK_CODE_VARINT;
+            } else {
+                fprintf(stderr, "Unknown book code format '%s'\n", optarg);
+                errflg++;
+                break;
+            }
+            
+            if (optSt->extractBytes) {
+                fprintf(stderr,"The book code format is detected when extracting, so -F will have no effect\n");
+            }
+        break;
+        case 'z':
+            if (optarg[0] == '-' && strlen(optarg) == 2) {
+                fprintf(stderr, "Option -z requires an argument\n");
+                errflg++;
+                break;
+            } else if (!isdigit(optarg[0]) || optarg[1] != '\0') {
+                fprintf(stderr, "Compression level must be from 0 to 9\n");
+                errflg++;
+                break;
+            }
+            
+            optSt->compressionLevel = atoi(optarg);
+            bkCdSt->bkCdCompression = BOOK_CODE_XZ;
+            
+            if (optSt->extractBytes) {
+                fprintf(stderr,"Compression is detected when extracting, so -z will have no effect\n");
+            }
+        break;
+        case 'w':
+            if (optarg[0] == '-' && strlen(optarg) == 2) {
+                fprintf(stderr, "Option -w requires an argument\n");
+                errflg++;
+                break;
+            } else if (!setOffsetWidth(bkCdSt, atoi(optarg))) {
+                fprintf(stderr, "Offset width must be 32, 40, 48 or 64\n");
+                errflg++;
+                break;
+            }
+            
+            if (optSt->extractBytes) {
+                fprintf(stderr,"Offset width is detected when extracting, so -w will have no effect\n");
+            }
+        break;
+        case 'C':
+            optSt->container = true;
+            
+            if (optSt->extractBytes) {
+                fprintf(stderr,"Containers are detected when extracting, so -C will have no effect\n");
             }
         break;
-        case 'h':
-            printHelp(binName);
-            exit(EXIT_SUCCESS);
+        case 'V':
+            optSt->noVerify = true;
+            
+            if (optSt->mapOffsets) {
+                fprintf(stderr,"Hashes are only checked when extracting, so -V will have no effect\n");
+            }
         break;
-        case 'd':
-            optSt->allowDuplicates = true;
+        case 'R':
+            if (optarg[0] == '-' && strlen(optarg) == 2) {
+                fprintf(stderr, "Option -R requires an argument\n");
+                errflg++;
+                break;
+            } else if (!parseRange(optarg, optSt)) {
+                fprintf(stderr, "Range must be given as START:LEN in bytes that fit in 64 bits, or START: to extract to the end\n");
+                errflg++;
+                break;
+            }
+            
+            if (optSt->mapOffsets) {
+                fprintf(stderr,"A range only applies when extracting, so -R will have no effect\n");
+            }
         break;
-        case 'p':
-            if(optSt->mapOffsets) {
-                optSt->writeToStdout = true;
-                optSt->outputFileGiven = true;
+        case 'W':
+            if (optarg[0] == '-' && strlen(optarg) == 2) {
+                fprintf(stderr, "Option -W requires an argument\n");
+                errflg++;
+                break;
             }
-            else if(optSt->extractBytes) {
-                optSt->readFromStdin = true;
-                optSt->bkCdGiven = true;
+            
+            /* The window is the book file buffer, which slides along the book file with the 
+             * original file instead of wrapping around each time a byte can't be found
+             */
+            optSt->slidingWindow = true;
+            optSt->bkFilBufSizeGiven = true;
+            bkFilSt->bkFilBufSize = atol(optarg) * sizeof(byte_t) * getBufSizeMultiple(optarg);
+            
+            if (optSt->extractBytes) {
+                fprintf(stderr,"The sliding window only applies when mapping, so -W will have no effect\n");
             }
         break;
-        case 'r':
-            optSt->resetAtEndOfBuf = true;
+        case 't':
+            if (optarg[0] == '-' && strlen(optarg) == 2) {
+                fprintf(stderr, "Option -t requires an argument\n");
+                errflg++;
+                break;
+            } else {
+                optSt->threadCount = atoi(optarg);
+                if (optSt->threadCount < 1) {
+                    fprintf(stderr, "Number of threads must be at least 1\n");
+                    errflg++;
+                }
+            }
         break;
         case ':':
             fprintf(stderr, "Option -%c requires an argument\n", optopt);
@@ -667,12 +4314,12 @@ struct optionsStruct *optSt
         }
     }
 
-    if(optSt->mapOffsets && optSt->extractBytes) {
-        fprintf(stderr, "-m and -e are mutually exlusive. Can only map or extract, not both.\n");
+    if(optSt->mapOffsets + optSt->extractBytes + optSt->buildIndex + optSt->analyzeBook > 1) {
+        fprintf(stderr, "-m, -e, -I and -A are mutually exlusive. Can only map, extract, build an index or analyze, one at a time.\n");
         errflg++;
     }
-    if(!optSt->mapOffsets && !optSt->extractBytes) {
-        fprintf(stderr, "Must specify to either map or extract (-m or -e)\n");
+    if(!optSt->mapOffsets && !optSt->extractBytes && !optSt->buildIndex && !optSt->analyzeBook) {
+        fprintf(stderr, "Must specify to either map, extract, build an index or analyze (-m, -e, -I or -A)\n");
         errflg++;
     }
     if( optSt->mapOffsets && !optSt->orgFilGiven) {
@@ -687,54 +4334,711 @@ struct optionsStruct *optSt
         fprintf(stderr, "Must specify a bookfile to use with -b\n");
         errflg++;
     }
-    if(!optSt->outputFileGiven) {
-        fprintf(stderr, "Must specify an output file with -f\n");
-        errflg++;
+    /* The index is written next to the book file unless it is given another name */
+    if(optSt->buildIndex && !optSt->outputFileGiven && optSt->bkFilGiven) {
+        optSt->outputFileGiven = true;
+        snprintf(bkFilSt->bkFilIndexName, NAME_MAX, "%.*s.index", NAME_MAX - 7, bkFilSt->bkFilName);
+    }
+    if(!optSt->outputFileGiven && !optSt->analyzeBook) {
+        fprintf(stderr, "Must specify an output file with -f\n");
+        errflg++;
+    }
+    if(optSt->ioUring && optSt->sortedGather) {
+        fprintf(stderr, "-U and -g are mutually exclusive. Book file pages are read either through io_uring or in a sorted sweep.\n");
+        errflg++;
+    }
+    if(optSt->slidingWindow && optSt->resetAtEndOfBuf) {
+        fprintf(stderr, "-W and -r are mutually exclusive. The book file buffer can't both slide and stay put.\n");
+        errflg++;
+    }
+    if(optSt->mapOffsets && optSt->readAhead && optSt->resetAtEndOfBuf) {
+        fprintf(stderr,"-r never moves on to another buffer of the book file, so -a will have no effect\n");
+        optSt->readAhead = false;
+    }
+    if(optSt->mapOffsets && optSt->pipeline && optSt->threadCount > 1) {
+        fprintf(stderr,"The pipeline is only used with a single mapping thread, so -P will have no effect\n");
+        optSt->pipeline = false;
+    }
+    if(optSt->uniqueOffsets && optSt->allowDuplicates) {
+        fprintf(stderr, "-u and -d are mutually exclusive. Offsets can't be both unique and duplicated.\n");
+        errflg++;
+    }
+    /* Without -r, mapping moves on to another buffer of the book file every time a byte can't be 
+     * found in the rest of this one, and building the position lists of every buffer it passes 
+     * through costs far more than scanning them does
+     */
+    if(optSt->mapOffsets && optSt->positionLists && !optSt->resetAtEndOfBuf) {
+        fprintf(stderr,"Position lists are only used with -r, so %s will have no effect\n", optSt->useIndex ? "-i" : "-l");
+        optSt->positionLists = false;
+        optSt->useIndex = false;
+    }
+
+    
+    
+    if (errflg) {
+        printHelp(binName);
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* Writes an index of the book file with the position lists of the buffers that mapping with -r 
+ * loads, which is the first buffer of each slice the book file is split into with -t, so that 
+ * mapping with --index can load them instead of sorting each buffer as it is read
+ */
+void buildBookIndex(struct bookFileStruct *bkFilSt, struct optionsStruct *optSt)
+{
+    int returnVal = 0;
+    struct bookIndexHeaderStruct header = {0};
+    
+    bkFilSt->bkFil = fopen(bkFilSt->bkFilName, "rb");
+    if (bkFilSt->bkFil == NULL) {
+        PRINT_FILE_ERROR(bkFilSt->bkFilName,errno);
+        exit(EXIT_FAILURE);
+    }
+    
+    bkFilSt->bkFilSize = getFileSize(bkFilSt->bkFilName);
+    
+    if(!optSt->bkFilBufSizeGiven)
+        bkFilSt->bkFilBufSize = DEFAULT_BUFFER_SIZE * sizeof(byte_t);
+    
+    if (bkFilSt->bkFilSize < bkFilSt->bkFilBufSize) {
+        bkFilSt->bkFilBufSize = bkFilSt->bkFilSize;
+    }
+    
+    if(bkFilSt->bkFilBufSize == 0 || bkFilSt->bkFilBufSize > UINT32_MAX) {
+        fprintf(stderr,"book_file_buffer must be from 1 to %lu bytes to build an index\n", (uint64_t)UINT32_MAX);
+        exit(EXIT_FAILURE);
+    }
+    
+    /* The slices are cut the same way mapOffsetsInParallel cuts them */
+    int threadCount = optSt->threadCount > 1 ? optSt->threadCount : 1;
+    size_t bkFilSliceSize = bkFilSt->bkFilSize / threadCount;
+    bkFilSliceSize -= bkFilSliceSize % bkFilSt->bkFilBufSize;
+    if (bkFilSliceSize == 0) {
+        fprintf(stderr,"Book file is too small to be split between %i threads with this book_file_buffer\n", threadCount);
+        exit(EXIT_FAILURE);
+    }
+    
+    bkFilSt->bkFilBuffer = malloc(bkFilSt->bkFilBufSize);
+    bkFilSt->bkFilPosList = malloc(bkFilSt->bkFilBufSize * sizeof(uint32_t));
+    if (bkFilSt->bkFilBuffer == NULL || bkFilSt->bkFilPosList == NULL) {
+        PRINT_SYS_ERROR(errno);
+        exit(EXIT_FAILURE);
+    }
+    
+    FILE *bkFilIndex = fopen(bkFilSt->bkFilIndexName, "wb");
+    if (bkFilIndex == NULL) {
+        PRINT_FILE_ERROR(bkFilSt->bkFilIndexName,errno);
+        exit(EXIT_FAILURE);
+    }
+    
+    if(optSt->verbosityLevel >= 1) {
+        fprintf(stderr,"Hashing book file...\n");
+    }
+    
+    memcpy(header.magic, BOOK_INDEX_MAGIC, sizeof(header.magic));
+    header.version = BOOK_INDEX_VERSION;
+    header.bkFilSize = bkFilSt->bkFilSize;
+    header.bkFilBufSize = bkFilSt->bkFilBufSize;
+    header.bufferCount = threadCount;
+    header.threadCount = threadCount;
+    header.bkFilHash = hashFile(bkFilSt->bkFilName, optSt->threadCount > 1 ? optSt->threadCount : (int)lzma_cputhreads(), NULL, 0);
+    
+    if(fwriteWErrCheck(&header, sizeof(header), 1, bkFilIndex, &returnVal) != 0) {
+        PRINT_FILE_ERROR(bkFilSt->bkFilIndexName,returnVal);
+        exit(EXIT_FAILURE);
+    }
+    
+    if(optSt->verbosityLevel >= 1) {
+        fprintf(stderr,"Indexing %lu buffers of %lu bytes\n", (uint64_t)header.bufferCount, (uint64_t)header.bkFilBufSize);
+    }
+    
+    for (int i = 0; i < threadCount; i++) {
+        uint64_t bufferStart = bkFilSliceSize * i;
+        
+        if (fseeko(bkFilSt->bkFil, bufferStart, SEEK_SET) != 0) {
+            PRINT_FILE_ERROR(bkFilSt->bkFilName,errno);
+            exit(EXIT_FAILURE);
+        }
+        if(freadWErrCheck(bkFilSt->bkFilBuffer, 1, bkFilSt->bkFilBufSize, bkFilSt->bkFil, &returnVal) != 0) {
+            PRINT_SYS_ERROR(returnVal);
+            exit(EXIT_FAILURE);
+        }
+        
+        indexBookBuffer(bkFilSt);
+        
+        uint64_t bufferHash = lzma_crc64(bkFilSt->bkFilBuffer, bkFilSt->bkFilBufSize, 0);
+        uint32_t listStarts[257 + 1] = {0};
+        for (int j = 0; j < 257; j++) {
+            listStarts[j] = bkFilSt->bkFilPosListStart[j];
+        }
+        
+        if(fwriteWErrCheck(&bufferStart, sizeof(bufferStart), 1, bkFilIndex, &returnVal) != 0
+            || fwriteWErrCheck(&bufferHash, sizeof(bufferHash), 1, bkFilIndex, &returnVal) != 0
+            || fwriteWErrCheck(listStarts, sizeof(listStarts), 1, bkFilIndex, &returnVal) != 0
+            || fwriteWErrCheck(bkFilSt->bkFilPosList, sizeof(uint32_t), bkFilSt->bkFilBufSize, bkFilIndex, &returnVal) != 0) {
+            PRINT_FILE_ERROR(bkFilSt->bkFilIndexName,returnVal);
+            exit(EXIT_FAILURE);
+        }
+        
+        if(optSt->verbosityLevel >= 2) {
+            fprintf(stderr,"Indexed bytes %lu-%lu of book file\n", (uint64_t)bufferStart, (uint64_t)(bufferStart + bkFilSt->bkFilBufSize));
+        }
+    }
+    
+    if(fclose(bkFilIndex) != 0) {
+        PRINT_FILE_ERROR(bkFilSt->bkFilIndexName,errno);
+        exit(EXIT_FAILURE);
+    }
+    fclose(bkFilSt->bkFil);
+    
+    free(bkFilSt->bkFilBuffer);
+    free(bkFilSt->bkFilPosList);
+    
+    fprintf(stderr,"Book index created for book file with hash %016lx\n", (uint64_t)header.bkFilHash);
+}
+
+/* Maps a book index into memory and checks that it was built from a book file of the same size. 
+ * The buffer size it was built with becomes the book file buffer size.
+ */
+void openBookIndex(struct bookFileStruct *bkFilSt, struct optionsStruct *optSt)
+{
+    struct bookIndexHeaderStruct header;
+    
+    int bkFilIndexDescriptor = open(bkFilSt->bkFilIndexName, O_RDONLY);
+    if (bkFilIndexDescriptor == -1) {
+        PRINT_FILE_ERROR(bkFilSt->bkFilIndexName,errno);
+        exit(EXIT_FAILURE);
+    }
+    
+    bkFilSt->bkFilIndexMapSize = getFileSize(bkFilSt->bkFilIndexName);
+    if (bkFilSt->bkFilIndexMapSize < sizeof(header)) {
+        fprintf(stderr,"%s is not a book index\n", bkFilSt->bkFilIndexName);
+        exit(EXIT_FAILURE);
+    }
+    
+    bkFilSt->bkFilIndexMap = mmap(NULL, bkFilSt->bkFilIndexMapSize, PROT_READ, MAP_SHARED, bkFilIndexDescriptor, 0);
+    if (bkFilSt->bkFilIndexMap == MAP_FAILED) {
+        PRINT_FILE_ERROR(bkFilSt->bkFilIndexName,errno);
+        exit(EXIT_FAILURE);
+    }
+    close(bkFilIndexDescriptor);
+    
+    memcpy(&header, bkFilSt->bkFilIndexMap, sizeof(header));
+    
+    if (memcmp(header.magic, BOOK_INDEX_MAGIC, sizeof(header.magic)) != 0 || header.version != BOOK_INDEX_VERSION) {
+        fprintf(stderr,"%s is not a book index\n", bkFilSt->bkFilIndexName);
+        exit(EXIT_FAILURE);
+    }
+    
+    if (header.bkFilSize != getFileSize(bkFilSt->bkFilName)) {
+        fprintf(stderr,"%s was built for a book file of %lu bytes, but %s is %lu bytes\n", bkFilSt->bkFilIndexName, (uint64_t)header.bkFilSize, bkFilSt->bkFilName, (uint64_t)getFileSize(bkFilSt->bkFilName));
+        exit(EXIT_FAILURE);
+    }
+    
+    if (header.bkFilBufSize == 0 || bkFilSt->bkFilIndexMapSize != sizeof(header) + header.bufferCount * bookIndexRecordSize(header.bkFilBufSize)) {
+        fprintf(stderr,"%s is truncated or damaged\n", bkFilSt->bkFilIndexName);
+        exit(EXIT_FAILURE);
+    }
+    
+    if (optSt->bkFilBufSizeGiven && bkFilSt->bkFilBufSize != header.bkFilBufSize) {
+        fprintf(stderr,"%s was built with a book_file_buffer of %lu bytes, which must be used with it\n", bkFilSt->bkFilIndexName, (uint64_t)header.bkFilBufSize);
+        exit(EXIT_FAILURE);
+    }
+    
+    if (header.threadCount != (uint64_t)(optSt->threadCount > 1 ? optSt->threadCount : 1)) {
+        fprintf(stderr,"%s was built for mapping with -t %lu, which must be used with it\n", bkFilSt->bkFilIndexName, (uint64_t)header.threadCount);
+        exit(EXIT_FAILURE);
+    }
+    
+    bkFilSt->bkFilBufSize = header.bkFilBufSize;
+    optSt->bkFilBufSizeGiven = true;
+    
+    if(optSt->verbosityLevel >= 1) {
+        fprintf(stderr,"Using book index %s of book file with hash %016lx\n", bkFilSt->bkFilIndexName, (uint64_t)header.bkFilHash);
+    }
+}
+
+/* Adds the number of each byte value in bytes to histogram. The counts are spread over four 
+ * tables so that runs of the same byte value don't have to wait on each other to increment one 
+ * counter, which lets it go as fast as the bytes can be loaded. count must be under 2^32.
+ */
+void histogramBytes(const byte_t *bytes, size_t count, uint64_t *histogram)
+{
+    uint32_t tables[4][256] = {{0}};
+    size_t i = 0;
+    
+    for (; i + 8 <= count; i += 8) {
+        uint64_t word;
+        memcpy(&word, bytes + i, sizeof(word));
+        tables[0][word & 0xFF]++;
+        tables[1][(word >> 8) & 0xFF]++;
+        tables[2][(word >> 16) & 0xFF]++;
+        tables[3][(word >> 24) & 0xFF]++;
+        tables[0][(word >> 32) & 0xFF]++;
+        tables[1][(word >> 40) & 0xFF]++;
+        tables[2][(word >> 48) & 0xFF]++;
+        tables[3][word >> 56]++;
+    }
+    for (; i < count; i++) {
+        tables[0][bytes[i]]++;
+    }
+    
+    for (int n = 0; n < 256; n++) {
+        histogram[n] += (uint64_t)tables[0][n] + tables[1][n] + tables[2][n] + tables[3][n];
+    }
+}
+
+/* Entropy in bits per byte of a histogram of count bytes */
+double histogramEntropy(const uint64_t *histogram, uint64_t count)
+{
+    double entropy = 0;
+    
+    for (int n = 0; n < 256; n++) {
+        if (histogram[n] > 0) {
+            double probability = (double)histogram[n] / count;
+            entropy -= probability * log2(probability);
+        }
+    }
+    
+    return entropy;
+}
+
+void startPrefixCover(struct prefixCoverStruct *cover)
+{
+    cover->deficit = 0;
+    for (int n = 0; n < 256; n++) {
+        cover->have[n] = 0;
+        if (cover->need[n] > 0) {
+            cover->deficit++;
+        }
+    }
+    cover->covered = cover->deficit == 0;
+    cover->end = 0;
+}
+
+/* Adds a block of the book file starting at blockStart to the prefix, given its histogram. Only 
+ * the block the prefix becomes covered in has to be gone through byte by byte to find exactly 
+ * where.
+ */
+void coverPrefix(struct prefixCoverStruct *cover, const byte_t *bytes, const uint64_t *blockHistogram, size_t count, uint64_t blockStart)
+{
+    if (cover->covered) {
+        return;
+    }
+    
+    int deficit = 0;
+    for (int n = 0; n < 256; n++) {
+        if (cover->have[n] + (int64_t)blockHistogram[n] < cover->need[n]) {
+            deficit++;
+        }
+    }
+    
+    if (deficit > 0) {
+        for (int n = 0; n < 256; n++) {
+            cover->have[n] += blockHistogram[n];
+        }
+        cover->deficit = deficit;
+        return;
+    }
+    
+    for (size_t i = 0; i < count; i++) {
+        if (++cover->have[bytes[i]] == cover->need[bytes[i]] && --cover->deficit == 0) {
+            cover->covered = true;
+            cover->end = blockStart + i + 1;
+            return;
+        }
+    }
+}
+
+void printShortfall(struct prefixCoverStruct *cover)
+{
+    for (int n = 0; n < 256; n++) {
+        if (cover->have[n] < cover->need[n]) {
+            printf("\t\tbyte 0x%02x: %ld needed, %ld in book file\n", n, (long)cover->need[n], (long)(cover->have[n] < 0 ? 0 : cover->have[n]));
+        }
+    }
+}
+
+/* Reads the book file once, reporting the entropy and byte values of it and of every window of 
+ * book_file_buffer bytes. Given an original file, it also predicts the smallest book_file_buffer 
+ * that the original can be mapped with using -r, which only ever uses the first buffer of the 
+ * book file. With -u, each byte value has to be in that buffer as many times as in the original, 
+ * which is exact. Without -u, every byte value of the original has to be in it after its first 
+ * byte, and twice for byte values that come up more than once so that the same offset isn't used 
+ * for them again. That is only a lower bound, since whether a byte value is found also depends on 
+ * where in the buffer the search for it starts.
+ */
+void analyzeBook(struct bookFileStruct *bkFilSt, struct originalFileStruct *orgFilSt, struct optionsStruct *optSt)
+{
+    int returnVal = 0;
+    uint64_t orgFilHistogram[256] = {0};
+    uint64_t bkFilHistogram[256] = {0};
+    uint64_t windowHistogram[256] = {0};
+    struct prefixCoverStruct reuseCover, uniqueCover;
+    size_t readBufSize = ANALYSIS_BLOCK_SIZE * 64;
+    
+    bkFilSt->bkFilSize = getFileSize(bkFilSt->bkFilName);
+    
+    if(!optSt->bkFilBufSizeGiven)
+        bkFilSt->bkFilBufSize = DEFAULT_BUFFER_SIZE * sizeof(byte_t);
+    if(bkFilSt->bkFilBufSize == 0 || bkFilSt->bkFilBufSize > bkFilSt->bkFilSize)
+        bkFilSt->bkFilBufSize = bkFilSt->bkFilSize;
+    
+    byte_t *readBuffer = malloc(readBufSize);
+    if (readBuffer == NULL) {
+        PRINT_SYS_ERROR(errno);
+        exit(EXIT_FAILURE);
+    }
+    
+    if (optSt->orgFilGiven) {
+        orgFilSt->orgFil = fopen(orgFilSt->orgFilName, "rb");
+        if (orgFilSt->orgFil == NULL) {
+            PRINT_FILE_ERROR(orgFilSt->orgFilName,errno);
+            exit(EXIT_FAILURE);
+        }
+        
+        size_t bytesRead;
+        while ((bytesRead = fread(readBuffer, 1, ANALYSIS_BLOCK_SIZE, orgFilSt->orgFil)) > 0) {
+            histogramBytes(readBuffer, bytesRead, orgFilHistogram);
+            orgFilSt->orgFilSize += bytesRead;
+        }
+        if (ferror(orgFilSt->orgFil)) {
+            PRINT_FILE_ERROR(orgFilSt->orgFilName,errno);
+            exit(EXIT_FAILURE);
+        }
+        fclose(orgFilSt->orgFil);
+    }
+    
+    for (int n = 0; n < 256; n++) {
+        reuseCover.need[n] = orgFilHistogram[n] < 2 ? (int64_t)orgFilHistogram[n] : 2;
+        uniqueCover.need[n] = orgFilHistogram[n];
+    }
+    startPrefixCover(&reuseCover);
+    startPrefixCover(&uniqueCover);
+    
+    bkFilSt->bkFil = fopen(bkFilSt->bkFilName, "rb");
+    if (bkFilSt->bkFil == NULL) {
+        PRINT_FILE_ERROR(bkFilSt->bkFilName,errno);
+        exit(EXIT_FAILURE);
+    }
+    
+    /* Windows are the buffers mapping would load, so the remainder of the book file past the 
+     * last whole one is left out of them
+     */
+    uint64_t windowCount = bkFilSt->bkFilBufSize > 0 ? bkFilSt->bkFilSize / bkFilSt->bkFilBufSize : 0;
+    uint64_t windowsMissingBytes = 0;
+    uint64_t windowNumber = 0;
+    size_t windowFill = 0;
+    double minEntropy = 8, maxEntropy = 0, totalEntropy = 0;
+    int minDistinct = 256;
+    
+    if(optSt->verbosityLevel >= 2) {
+        printf("%-12s %-12s %-8s %-8s %s\n", "window", "offset", "entropy", "values", optSt->orgFilGiven ? "missing values of original" : "");
+    }
+    
+    uint64_t position = 0;
+    size_t bytesRead;
+    while ((bytesRead = fread(readBuffer, 1, readBufSize, bkFilSt->bkFil)) > 0) {
+        for (size_t blockStart = 0; blockStart < bytesRead; ) {
+            
+            /* Blocks are cut short where a window ends so each block belongs to one window */
+            size_t blockSize = bytesRead - blockStart;
+            if (blockSize > ANALYSIS_BLOCK_SIZE)
+                blockSize = ANALYSIS_BLOCK_SIZE;
+            if (windowNumber < windowCount && blockSize > bkFilSt->bkFilBufSize - windowFill)
+                blockSize = bkFilSt->bkFilBufSize - windowFill;
+            
+            byte_t *block = readBuffer + blockStart;
+            uint64_t blockHistogram[256] = {0};
+            histogramBytes(block, blockSize, blockHistogram);
+            
+            /* Mapping never goes back to the first byte of a buffer with -r after starting */
+            if (position == 0 && blockSize > 0) {
+                reuseCover.have[block[0]]--;
+            }
+            coverPrefix(&reuseCover, block, blockHistogram, blockSize, position);
+            coverPrefix(&uniqueCover, block, blockHistogram, blockSize, position);
+            
+            for (int n = 0; n < 256; n++) {
+                bkFilHistogram[n] += blockHistogram[n];
+                windowHistogram[n] += blockHistogram[n];
+            }
+            
+            position += blockSize;
+            blockStart += blockSize;
+            windowFill += blockSize;
+            
+            if (windowNumber < windowCount && windowFill == bkFilSt->bkFilBufSize) {
+                double entropy = histogramEntropy(windowHistogram, windowFill);
+                int distinct = 0, missing = 0;
+                for (int n = 0; n < 256; n++) {
+                    distinct += windowHistogram[n] > 0;
+                    missing += windowHistogram[n] == 0 && orgFilHistogram[n] > 0;
+                }
+                
+                if (entropy < minEntropy)
+                    minEntropy = entropy;
+                if (entropy > maxEntropy)
+                    maxEntropy = entropy;
+                if (distinct < minDistinct)
+                    minDistinct = distinct;
+                totalEntropy += entropy;
+                windowsMissingBytes += missing > 0;
+                
+                if(optSt->verbosityLevel >= 2) {
+                    printf("%-12lu %-12lu %-8.4f %-8i", (uint64_t)windowNumber, (uint64_t)(position - windowFill), entropy, distinct);
+                    if (optSt->orgFilGiven) {
+                        printf(" %i", missing);
+                    }
+                    printf("\n");
+                }
+                
+                memset(windowHistogram, 0, sizeof(windowHistogram));
+                windowFill = 0;
+                windowNumber++;
+            }
+        }
+    }
+    
+    if (ferror(bkFilSt->bkFil)) {
+        returnVal = errno;
+        PRINT_FILE_ERROR(bkFilSt->bkFilName,returnVal);
+        exit(EXIT_FAILURE);
+    }
+    fclose(bkFilSt->bkFil);
+    free(readBuffer);
+    
+    int bkFilDistinct = 0;
+    for (int n = 0; n < 256; n++) {
+        bkFilDistinct += bkFilHistogram[n] > 0;
+    }
+    
+    printf("Book file: %lu bytes, %.4f bits of entropy per byte, %i byte values\n", (uint64_t)position, histogramEntropy(bkFilHistogram, position), bkFilDistinct);
+    if (windowCount > 0) {
+        printf("Windows of book_file_buffer %lu bytes: %lu, entropy %.4f min %.4f avg %.4f max, at least %i byte values in each\n", (uint64_t)bkFilSt->bkFilBufSize, (uint64_t)windowCount, minEntropy, totalEntropy / windowCount, maxEntropy, minDistinct);
+    }
+    
+    if (!optSt->orgFilGiven) {
+        return;
+    }
+    
+    int orgFilDistinct = 0, missingFromBook = 0;
+    for (int n = 0; n < 256; n++) {
+        orgFilDistinct += orgFilHistogram[n] > 0;
+        missingFromBook += orgFilHistogram[n] > 0 && bkFilHistogram[n] == 0;
+    }
+    
+    printf("Original file: %lu bytes, %.4f bits of entropy per byte, %i byte values\n", (uint64_t)orgFilSt->orgFilSize, histogramEntropy(orgFilHistogram, orgFilSt->orgFilSize), orgFilDistinct);
+    
+    if (missingFromBook > 0) {
+        printf("%i byte values of the original file are not in the book file at all, so it can't be mapped to it:\n", missingFromBook);
+        for (int n = 0; n < 256; n++) {
+            if (orgFilHistogram[n] > 0 && bkFilHistogram[n] == 0) {
+                printf("\t\tbyte 0x%02x: %lu in original file\n", n, (uint64_t)orgFilHistogram[n]);
+            }
+        }
+        return;
+    }
+    
+    if (windowCount > 0) {
+        printf("Windows of book_file_buffer missing byte values of the original file: %lu of %lu\n", (uint64_t)windowsMissingBytes, (uint64_t)windowCount);
     }
     
+    if (reuseCover.covered) {
+        printf("Smallest book_file_buffer to map with -r: at least %lu bytes (-s book_file_buffer=%lub)\n", (uint64_t)reuseCover.end, (uint64_t)reuseCover.end);
+    } else {
+        printf("The original file can't be mapped with -r with any book_file_buffer, since the book file is short of:\n");
+        printShortfall(&reuseCover);
+    }
     
-    if (errflg) {
-        printHelp(binName);
-        exit(EXIT_FAILURE);
+    if (uniqueCover.covered) {
+        printf("Smallest book_file_buffer to map with -r -u: %lu bytes (-s book_file_buffer=%lub)\n", (uint64_t)uniqueCover.end, (uint64_t)uniqueCover.end);
+    } else {
+        printf("The original file can't be mapped with -u, since the book file is short of:\n");
+        printShortfall(&uniqueCover);
     }
 }
 
-size_t bytesOfRamAvailable(void) {
-    FILE *meminfoFile = fopen("/proc/meminfo", "r");
-    if(meminfoFile == NULL) {
-        PRINT_FILE_ERROR("/proc/meminfo",errno);
+void *histogramWorker(void *arg)
+{
+    struct histogramWorkerStruct *worker = arg;
+    size_t readBufSize = ANALYSIS_BLOCK_SIZE * 16;
+    
+    FILE *file = fopen(worker->fileName, "rb");
+    if (file == NULL) {
+        PRINT_FILE_ERROR(worker->fileName,errno);
         exit(EXIT_FAILURE);
     }
-
-    char meminfoLine[256];
-    while(fgets(meminfoLine, sizeof(meminfoLine), meminfoFile))
-    {
-        size_t availableMemory;
-        if(sscanf(meminfoLine, "MemAvailable: %lu kB", &availableMemory) == 1)
-        {
-            fclose(meminfoFile);
-            return availableMemory * 1024;
-        }
+    
+    byte_t *readBuffer = malloc(readBufSize);
+    if (readBuffer == NULL) {
+        PRINT_SYS_ERROR(errno);
+        exit(EXIT_FAILURE);
     }
-
-    fclose(meminfoFile);
     
-    printf("Could not read available system memory\n");
+    for (int i = 0; i < worker->regionCount; i++) {
+        size_t regionStart = worker->regionStride * i;
+        if (regionStart >= worker->fileSize) {
+            break;
+        }
+        size_t bytesRemaining = worker->fileSize - regionStart;
+        if (bytesRemaining > worker->regionSize) {
+            bytesRemaining = worker->regionSize;
+        }
+        
+        if (fseeko(file, regionStart, SEEK_SET) != 0) {
+            PRINT_FILE_ERROR(worker->fileName,errno);
+            exit(EXIT_FAILURE);
+        }
+        
+        size_t regionPos = 0;
+        while (bytesRemaining > 0) {
+            size_t currentChunk = bytesRemaining < readBufSize ? bytesRemaining : readBufSize;
+            if (fread(readBuffer, 1, currentChunk, file) != currentChunk) {
+                PRINT_FILE_ERROR(worker->fileName,ferror(file) ? errno : EIO);
+                exit(EXIT_FAILURE);
+            }
+            if (regionPos == 0) {
+                worker->firstBytes[i] = readBuffer[0];
+            }
+            for (size_t blockStart = 0; blockStart < currentChunk; blockStart += ANALYSIS_BLOCK_SIZE) {
+                size_t blockSize = currentChunk - blockStart < ANALYSIS_BLOCK_SIZE ? currentChunk - blockStart : ANALYSIS_BLOCK_SIZE;
+                histogramBytes(readBuffer + blockStart, blockSize, worker->histograms[i]);
+            }
+            
+            /* Take back the first byte of every buffer that isn't to be counted */
+            if (worker->skipEvery > 0) {
+                for (size_t p = (worker->skipEvery - regionPos % worker->skipEvery) % worker->skipEvery; p < currentChunk; p += worker->skipEvery) {
+                    worker->histograms[i][readBuffer[p]]--;
+                }
+            }
+            
+            regionPos += currentChunk;
+            bytesRemaining -= currentChunk;
+        }
+    }
     
-    exit(EXIT_FAILURE);
+    free(readBuffer);
+    fclose(file);
     
+    return NULL;
 }
 
-size_t getFileSize(const char *filename)
+/* Checks that the original file can be mapped to the book file before anything is written, 
+ * instead of finding out when mapping reaches a byte that can't be. The original file and the 
+ * part of the book file that mapping will use are histogrammed at the same time in two threads, 
+ * split up the same way mapping with -t splits them. Each segment of the original file needs 
+ * every byte value it has to be in its slice of the book file, or in the first buffer of the 
+ * slice with -r. Unless duplicates are allowed, byte values that come up more than once need to 
+ * be there twice so the same offset isn't used for them again, and with -u they need to be there 
+ * as many times as in the segment. Without -u, searching a buffer that has been loaded again 
+ * starts after its first byte, so the first byte of each buffer is left out. Only the first byte 
+ * of the segment can still be mapped to the first byte of the slice, since it is looked for 
+ * before anything else.
+ */
+void checkMappingFeasibility(struct bookFileStruct *bkFilSt, struct originalFileStruct *orgFilSt, struct optionsStruct *optSt)
 {
-    struct stat st;
+    int sliceCount = optSt->threadCount > 1 ? optSt->threadCount : 1;
+    size_t bkFilUsableSize = bkFilSt->bkFilSize - bkFilSt->bkFilSize % bkFilSt->bkFilBufSize;
+    size_t bkFilSliceSize = bkFilUsableSize / sliceCount;
+    bkFilSliceSize -= bkFilSliceSize % bkFilSt->bkFilBufSize;
     
-    if(stat(filename, &st) == -1) {
+    if (bkFilSliceSize == 0) {
+        fprintf(stderr,"Book file is too small to be split between %i threads with this book_file_buffer\n", sliceCount);
+        exit(EXIT_FAILURE);
+    }
+    
+    if(optSt->verbosityLevel >= 1) {
+        fprintf(stderr,"Checking that the original file can be mapped to the book file...\n");
+    }
+    
+    uint64_t (*orgFilHistograms)[256] = calloc(sliceCount, sizeof(*orgFilHistograms));
+    uint64_t (*bkFilHistograms)[256] = calloc(sliceCount, sizeof(*bkFilHistograms));
+    int *orgFilFirstBytes = malloc(sliceCount * sizeof(int));
+    int *bkFilFirstBytes = malloc(sliceCount * sizeof(int));
+    if (orgFilHistograms == NULL || bkFilHistograms == NULL || orgFilFirstBytes == NULL || bkFilFirstBytes == NULL) {
         PRINT_SYS_ERROR(errno);
         exit(EXIT_FAILURE);
     }
     
-    return st.st_size;
+    struct histogramWorkerStruct workers[2];
+    
+    workers[0].fileName = orgFilSt->orgFilName;
+    workers[0].fileSize = orgFilSt->orgFilSize;
+    workers[0].regionStride = (orgFilSt->orgFilSize + sliceCount - 1) / sliceCount;
+    workers[0].regionSize = workers[0].regionStride;
+    workers[0].regionCount = sliceCount;
+    workers[0].skipEvery = 0;
+    workers[0].histograms = orgFilHistograms;
+    workers[0].firstBytes = orgFilFirstBytes;
+    
+    workers[1].fileName = bkFilSt->bkFilName;
+    workers[1].fileSize = bkFilUsableSize;
+    workers[1].regionStride = bkFilSliceSize;
+    workers[1].regionSize = optSt->resetAtEndOfBuf ? bkFilSt->bkFilBufSize : bkFilSliceSize;
+    workers[1].regionCount = sliceCount;
+    workers[1].skipEvery = optSt->uniqueOffsets ? 0 : bkFilSt->bkFilBufSize;
+    workers[1].histograms = bkFilHistograms;
+    workers[1].firstBytes = bkFilFirstBytes;
+    
+    for (int i = 0; i < sliceCount; i++) {
+        orgFilFirstBytes[i] = -1;
+        bkFilFirstBytes[i] = -1;
+    }
+    
+    for (int i = 0; i < 2; i++) {
+        int errCode = pthread_create(&workers[i].thread, NULL, histogramWorker, &workers[i]);
+        if (errCode != 0) {
+            PRINT_SYS_ERROR(errCode);
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (int i = 0; i < 2; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+    
+    int shortfalls = 0;
+    for (int i = 0; i < sliceCount; i++) {
+        if (workers[1].skipEvery > 0 && orgFilFirstBytes[i] != -1 && orgFilFirstBytes[i] == bkFilFirstBytes[i]) {
+            orgFilHistograms[i][orgFilFirstBytes[i]]--;
+        }
+        
+        for (int n = 0; n < 256; n++) {
+            uint64_t need = orgFilHistograms[i][n];
+            if (optSt->allowDuplicates && need > 1) {
+                need = 1;
+            } else if (!optSt->uniqueOffsets && need > 2) {
+                need = 2;
+            }
+            
+            if (bkFilHistograms[i][n] < need) {
+                if (shortfalls++ == 0) {
+                    fprintf(stderr,"The original file can't be mapped to the %s:\n", optSt->resetAtEndOfBuf ? "book file buffer" : "book file");
+                }
+                if (sliceCount > 1) {
+                    fprintf(stderr,"\t\tthread %i: ", i);
+                } else {
+                    fprintf(stderr,"\t\t");
+                }
+                if (bkFilHistograms[i][n] == 0) {
+                    fprintf(stderr,"byte 0x%02x is missing, it is in the original file %lu times\n", n, (uint64_t)orgFilHistograms[i][n]);
+                } else {
+                    fprintf(stderr,"byte 0x%02x is there %lu times but %lu are needed\n", n, (uint64_t)bkFilHistograms[i][n], need);
+                }
+            }
+        }
+    }
+    
+    free(orgFilHistograms);
+    free(bkFilHistograms);
+    free(orgFilFirstBytes);
+    free(bkFilFirstBytes);
+    
+    if (shortfalls > 0) {
+        fprintf(stderr,"Not enough entropy in book file or book buffer, book code could not be created\n");
+        exit(EXIT_FAILURE);
+    }
 }
 
 int main(int argc, char *argv[])
@@ -752,9 +5056,19 @@ int main(int argc, char *argv[])
     struct offsetStruct oSetSt;
     struct optionsStruct optSt = {0};
     
-    parseOptions(argc, argv, &bkFilSt, &bkCdSt, &orgFilSt, &extrFilSt, &oSetSt, &optSt);
+    initCrc32c();
+    
+    bkCdSt.bkCdFormat = BOOK_CODE_RAW;
+    bkCdSt.bkCdCompression = BOOK_CODE_UNCOMPRESSED;
+    setOffsetWidth(&bkCdSt, DEFAULT_OFFSET_WIDTH);
+    
+    parseOptions(argc, argv, &bkFilSt, &bkCdSt, &orgFilSt, &extrFilSt, &optSt);
 
     bkFilSt.bkFil = NULL;
+    bkFilSt.bkFilMap = NULL;
+    bkFilSt.bkFilUring = NULL;
+    bkFilSt.bkFilIndexMap = NULL;
+    bkFilSt.bkFilUnusedBits = NULL;
     bkCdSt.bkCd = NULL;
     orgFilSt.orgFil = NULL;
     extrFilSt.extrFil = NULL;
@@ -763,14 +5077,35 @@ int main(int argc, char *argv[])
     orgFilSt.orgFilByte = 0;
 
     bkCdSt.bkCdSize = 0;
+    bkCdSt.bkCdPrevOffset = 0;
+    bkCdSt.bkCdCodedBufPos = 0;
+    bkCdSt.bkCdCodedBufLen = 0;
+    bkCdSt.bkCdEnd = false;
+    bkCdSt.bkCdReadEnd = UINT64_MAX;
+    bkCdSt.bkCdContainer = false;
+    bkCdSt.bkCdBookRecorded = false;
+    bkCdSt.bkCdBlocks = NULL;
+    bkCdSt.bkCdBlockCount = 0;
+    bkCdSt.bkCdBlocksAllocated = 0;
+    bkCdSt.bkCdOffsetCount = 0;
+    bkCdSt.bkCdOffsetsLeft = UINT64_MAX;
+    bkCdSt.bkCdBytesWritten = 0;
+    bkCdSt.bkCdOrgFilCrcs = NULL;
+    bkCdSt.bkCdCheckPos = UINT64_MAX;
+    bkCdSt.bkCdOrgCheckPos = UINT64_MAX;
+    bkCdSt.bkCdBlocksChecked = 0;
     bkFilSt.bkFilSize = 0;
     orgFilSt.orgFilSize = 0;
 
     bkFilSt.bkFilPos = 0;
+    bkFilSt.bkFilStart = 0;
     bkFilSt.bkFilBufPos = 0;
     extrFilSt.extrFilBufPos = 0;
 
     oSetSt.byteOffset = 0;
+    oSetSt.localityBlockCount = 0;
+    oSetSt.localitySpanTotal = 0;
+    oSetSt.localityBlocks = 0;
 
     /* This digest will store offsets corresponding to byte values that have been mapped to a file 
      * from the original byte already in order to avoid consecutive repeats, though not necessarily 
@@ -780,7 +5115,19 @@ int main(int argc, char *argv[])
     for (int i = 0; i < 256; i++)
         oSetSt.offsetDigest[i] = -1;
 
-    if (optSt.mapOffsets) {
+    if (optSt.buildIndex) {
+        
+        buildBookIndex(&bkFilSt, &optSt);
+        
+        exit(EXIT_SUCCESS);
+        
+    } else if (optSt.analyzeBook) {
+        
+        analyzeBook(&bkFilSt, &orgFilSt, &optSt);
+        
+        exit(EXIT_SUCCESS);
+        
+    } else if (optSt.mapOffsets) {
         
         /*Open Files*/
         bkFilSt.bkFil = fopen(bkFilSt.bkFilName, "rb");
@@ -789,16 +5136,6 @@ int main(int argc, char *argv[])
             exit(EXIT_FAILURE);
         }
 
-        if(optSt.writeToStdout) {
-            bkCdSt.bkCd = stdout;
-        } else {
-            bkCdSt.bkCd = fopen(bkCdSt.bkCdFilName, "wb");
-            if (bkCdSt.bkCd == NULL) {
-                PRINT_FILE_ERROR(bkCdSt.bkCdFilName,errno);
-                exit(EXIT_FAILURE);
-            }
-        }
-
         orgFilSt.orgFil = fopen(orgFilSt.orgFilName, "rb");
         if (orgFilSt.orgFil == NULL) {
             PRINT_FILE_ERROR(orgFilSt.orgFilName,errno);
@@ -809,6 +5146,19 @@ int main(int argc, char *argv[])
         orgFilSt.orgFilSize = getFileSize(orgFilSt.orgFilName);        
         bkFilSt.bkFilSize = getFileSize(bkFilSt.bkFilName);
         
+        /* Only as much of the book file as the offset width can reach is used */
+        if(bkCdSt.bkCdOffsetWidth < 64 && bkFilSt.bkFilSize > (size_t)1 << bkCdSt.bkCdOffsetWidth) {
+            bkFilSt.bkFilSize = (size_t)1 << bkCdSt.bkCdOffsetWidth;
+            if(optSt.verbosityLevel >= 1) {
+                fprintf(stderr,"Only the first %lu bytes of the book file can be used with %i bit offsets\n", (uint64_t)bkFilSt.bkFilSize, bkCdSt.bkCdOffsetWidth);
+            }
+        }
+        
+        /* A book index decides the book file buffer size */
+        if(optSt.useIndex) {
+            openBookIndex(&bkFilSt, &optSt);
+        }
+        
         /*Set buffer sizes*/
         if(!optSt.bkFilBufSizeGiven)
             bkFilSt.bkFilBufSize = DEFAULT_BUFFER_SIZE * sizeof(byte_t);
@@ -829,12 +5179,49 @@ int main(int argc, char *argv[])
                 bkFilSt.bkFilBufSize = bkFilSt.bkFilSize;
         }
         
+        if(!optSt.bkCdBufSizeGiven)
+            bkCdSt.bkCdBufSize = DEFAULT_BUFFER_SIZE * sizeof(byte_t);
+        else
+            bkCdSt.bkCdBufSize /= bkCdSt.bkCdOffsetBytes;
+        
+        /* Like when extracting, the book code buffer holds as many offsets as book_code_buffer 
+         * bytes of offsets of the chosen width, one for each byte of the original file, but holds 
+         * them as uoffset_t. It must hold at least one.
+         */
+        if(bkCdSt.bkCdBufSize == 0)
+            bkCdSt.bkCdBufSize = 1;
+        bkCdSt.bkCdBufSize *= sizeof(oSetSt.byteOffset);
+        bkCdSt.bkCdBufPos = 0;
+        
         if(optSt.verbosityLevel >= 1) {
-            fprintf(stderr,"book_file_buffer %lu bytes\noriginal_file_buffer %lu bytes\n", (uint64_t)bkFilSt.bkFilBufSize, (uint64_t)orgFilSt.orgFilBufSize);
+            fprintf(stderr,"book_file_buffer %lu bytes\noriginal_file_buffer %lu bytes\nbook_code_buffer %lu offsets\n", (uint64_t)bkFilSt.bkFilBufSize, (uint64_t)orgFilSt.orgFilBufSize, (uint64_t)(bkCdSt.bkCdBufSize / sizeof(oSetSt.byteOffset)));
+        }
+        
+        /* Position lists hold positions within the book file buffer in 32 bits */
+        if(optSt.positionLists && bkFilSt.bkFilBufSize > UINT32_MAX) {
+            fprintf(stderr,"book_file_buffer can be at most %lu bytes with --position-lists\n", (uint64_t)UINT32_MAX);
+            exit(EXIT_FAILURE);
+        }
+        
+        /* Nothing is written until the book file is known to have what the original file needs */
+        checkMappingFeasibility(&bkFilSt, &orgFilSt, &optSt);
+        
+        if(optSt.writeToStdout) {
+            bkCdSt.bkCd = stdout;
+        } else {
+            bkCdSt.bkCd = fopen(bkCdSt.bkCdFilName, "wb");
+            if (bkCdSt.bkCd == NULL) {
+                PRINT_FILE_ERROR(bkCdSt.bkCdFilName,errno);
+                exit(EXIT_FAILURE);
+            }
         }
         
         /*Check available memory*/
-        if((orgFilSt.orgFilBufSize + bkFilSt.bkFilBufSize) > bytesOfRamAvailable()) {
+        size_t posListSize = optSt.positionLists ? bkFilSt.bkFilBufSize * sizeof(uint32_t) * (optSt.useIndex ? 0 : 1) + (optSt.uniqueOffsets ? bkFilSt.bkFilBufSize / 8 : 0) : 0;
+        size_t usedMapSize = optSt.uniqueOffsets ? bkFilSt.bkFilSize / CHAR_BIT : 0;
+        size_t readAheadSize = useBookReadAhead(&bkFilSt, &optSt) ? bkFilSt.bkFilBufSize : 0;
+        size_t pipelineSize = useMapPipeline(&orgFilSt, &bkCdSt, &optSt) ? (PIPELINE_SLOTS - 1) * (orgFilSt.orgFilBufSize + bkCdSt.bkCdBufSize) : 0;
+        if((orgFilSt.orgFilBufSize + bkFilSt.bkFilBufSize + readAheadSize + pipelineSize + bkCdSt.bkCdBufSize + posListSize) * (optSt.threadCount > 1 ? optSt.threadCount : 1) + usedMapSize > bytesOfRamAvailable()) {
             printf("Not enough available memory for specified buffer size\n");
             exit(EXIT_FAILURE);
         }
@@ -852,6 +5239,102 @@ int main(int argc, char *argv[])
             exit(EXIT_FAILURE);
         }
         
+        bkCdSt.bkCdBuffer = malloc(bkCdSt.bkCdBufSize);
+        if (bkCdSt.bkCdBuffer == NULL) {
+            PRINT_SYS_ERROR(errno);
+            exit(EXIT_FAILURE);
+        }
+        
+        /* Offsets are packed to the offset width or encoded in the coded buffer before being 
+         * written. Encoded offsets can take up more room than raw ones, in the worst case.
+         */
+        bkCdSt.bkCdCodedBufSize = (bkCdSt.bkCdBufSize / sizeof(oSetSt.byteOffset)) * MAX_VARINT_BYTES;
+        bkCdSt.bkCdCodedBuffer = malloc(bkCdSt.bkCdCodedBufSize);
+        if (bkCdSt.bkCdCodedBuffer == NULL) {
+            PRINT_SYS_ERROR(errno);
+            exit(EXIT_FAILURE);
+        }
+        
+        /* A container records the book file it was mapped with and the original file, so the book 
+         * file used to extract it and what is extracted can be checked against them. The header 
+         * comes first even on stdout, so both are hashed before mapping.
+         */
+        if(optSt.container) {
+            int hashThreads = optSt.threadCount > 1 ? optSt.threadCount : (int)lzma_cputhreads();
+            
+            if(optSt.verbosityLevel >= 1) {
+                fprintf(stderr,"Hashing book file and original file...\n");
+            }
+            
+            bkCdSt.bkCdContainer = true;
+            memset(&bkCdSt.bkCdContainerHeader, 0, sizeof(bkCdSt.bkCdContainerHeader));
+            bkCdSt.bkCdContainerHeader.orgFilSize = orgFilSt.orgFilSize;
+            bkCdSt.bkCdContainerHeader.bkFilSize = getFileSize(bkFilSt.bkFilName);
+            bkCdSt.bkCdContainerHeader.bkFilHash = hashFile(bkFilSt.bkFilName, hashThreads, NULL, 0);
+            
+            /* The checksum of each block of the original file goes in the block index */
+            bkCdSt.bkCdOrgFilCrcs = calloc(orgFilSt.orgFilSize / BLOCK_OFFSETS + 1, sizeof(uint32_t));
+            if (bkCdSt.bkCdOrgFilCrcs == NULL) {
+                PRINT_SYS_ERROR(errno);
+                exit(EXIT_FAILURE);
+            }
+            bkCdSt.bkCdContainerHeader.orgFilHash = hashFile(orgFilSt.orgFilName, hashThreads, bkCdSt.bkCdOrgFilCrcs, BLOCK_OFFSETS);
+            bkCdSt.bkCdContainerHeader.blockOffsets = BLOCK_OFFSETS;
+            
+            if(optSt.verbosityLevel >= 1) {
+                fprintf(stderr,"Book file hash is %016lx, original file hash is %016lx\n", (uint64_t)bkCdSt.bkCdContainerHeader.bkFilHash, (uint64_t)bkCdSt.bkCdContainerHeader.orgFilHash);
+            }
+        }
+        
+        /* A plain 32 bit raw book code is left without a header so older versions can read it. 
+         * Any other records the book file it was mapped with in its header, like a container does.
+         */
+        if(bkCdSt.bkCdFormat != BOOK_CODE_RAW || bkCdSt.bkCdCompression != BOOK_CODE_UNCOMPRESSED || bkCdSt.bkCdOffsetWidth != DEFAULT_OFFSET_WIDTH || bkCdSt.bkCdContainer) {
+            if(!bkCdSt.bkCdContainer) {
+                if(optSt.verbosityLevel >= 1) {
+                    fprintf(stderr,"Hashing book file...\n");
+                }
+                
+                memset(&bkCdSt.bkCdContainerHeader, 0, sizeof(bkCdSt.bkCdContainerHeader));
+                bkCdSt.bkCdContainerHeader.bkFilSize = getFileSize(bkFilSt.bkFilName);
+                bkCdSt.bkCdContainerHeader.bkFilHash = hashFile(bkFilSt.bkFilName, optSt.threadCount > 1 ? optSt.threadCount : (int)lzma_cputhreads(), NULL, 0);
+            }
+            
+            writeBookCodeHeader(&bkCdSt);
+        }
+        
+        if(bkCdSt.bkCdCompression != BOOK_CODE_UNCOMPRESSED) {
+            /* Compress with as many threads as mapping uses, or every core if not given */
+            int compressionThreads = optSt.threadCount > 1 ? optSt.threadCount : (int)lzma_cputhreads();
+            if(compressionThreads < 1)
+                compressionThreads = 1;
+            
+            if(optSt.verbosityLevel >= 1) {
+                fprintf(stderr,"Compressing book code at level %i with %i threads\n", optSt.compressionLevel, compressionThreads);
+            }
+            
+            startBookCodeCompression(&bkCdSt, optSt.compressionLevel, compressionThreads, false);
+        }
+        
+        bkFilSt.bkFilPosList = NULL;
+        if(optSt.positionLists && !optSt.useIndex) {
+            bkFilSt.bkFilPosList = malloc(bkFilSt.bkFilBufSize * sizeof(uint32_t));
+            if (bkFilSt.bkFilPosList == NULL) {
+                PRINT_SYS_ERROR(errno);
+                exit(EXIT_FAILURE);
+            }
+        }
+        
+        bkFilSt.bkFilUsedMap = NULL;
+        if(optSt.uniqueOffsets) {
+            allocUsedOffsetMap(&bkFilSt, bkFilSt.bkFilSize);
+            
+            /* Position lists can skip straight past used offsets */
+            if(optSt.positionLists) {
+                allocUnusedPositions(&bkFilSt);
+            }
+        }
+        
         /*Set how much of bkFil to use*/
         
         /* bkFilSize needs to be an even multiple of the buffer size. This means the remainder 
@@ -863,7 +5346,20 @@ int main(int argc, char *argv[])
             fprintf(stderr,"Mapping offsets...\n");
         }
         
-        mapOffsets(&bkFilSt,&bkCdSt,&orgFilSt,&oSetSt,&optSt);
+        if(optSt.threadCount > 1) {
+            mapOffsetsInParallel(&bkFilSt,&bkCdSt,&orgFilSt,&oSetSt,&optSt);
+        } else {
+            mapOffsets(&bkFilSt,&bkCdSt,&orgFilSt,&oSetSt,&optSt);
+        }
+        
+        finishBookCode(&bkCdSt);
+        
+        /* Extraction reads the book file in the order of the offsets, so the less of it each block 
+         * of them spans the fewer pages it touches
+         */
+        if(oSetSt.localityBlocks > 0) {
+            fprintf(stderr,"Extraction locality: each %i MB of the original file spans %.1f MB of the book file on average\n", LOCALITY_BLOCK_OFFSETS / (1024 * 1024), (double)oSetSt.localitySpanTotal / oSetSt.localityBlocks / (1024 * 1024));
+        }
         
         fprintf(stderr,"Book code created\n");
         
@@ -879,6 +5375,21 @@ int main(int argc, char *argv[])
         
         free(bkFilSt.bkFilBuffer);
         free(orgFilSt.orgFilBuffer);
+        if(!optSt.useIndex) {
+            free(bkFilSt.bkFilPosList);
+        }
+        if(bkFilSt.bkFilIndexMap != NULL) {
+            munmap(bkFilSt.bkFilIndexMap, bkFilSt.bkFilIndexMapSize);
+        }
+        freeUsedOffsetMap(&bkFilSt);
+        free(bkFilSt.bkFilUnusedBits);
+        free(bkCdSt.bkCdBuffer);
+        free(bkCdSt.bkCdCodedBuffer);
+        free(bkCdSt.bkCdBlocks);
+        free(bkCdSt.bkCdOrgFilCrcs);
+        if(bkCdSt.bkCdCompression != BOOK_CODE_UNCOMPRESSED) {
+            stopBookCodeCompression(&bkCdSt);
+        }
         
         exit(EXIT_SUCCESS);
 
@@ -908,35 +5419,93 @@ int main(int argc, char *argv[])
         }
 
         /*Get file sizes*/
-        bkCdSt.bkCdSize = getFileSize(bkFilSt.bkFilName);
+        bkFilSt.bkFilSize = getFileSize(bkFilSt.bkFilName);
+        if(!optSt.readFromStdin) {
+            bkCdSt.bkCdSize = getFileSize(bkCdSt.bkCdFilName);
+        }
+        
+        /* Map the book file into memory so that offsets can be looked up without seeking. If it 
+         * can't be mapped, fall back to seeking to each offset in the book file.
+         */
+        bkFilSt.bkFilMap = mmap(NULL, bkFilSt.bkFilSize, PROT_READ, MAP_PRIVATE, fileno(bkFilSt.bkFil), 0);
+        if (bkFilSt.bkFilMap == MAP_FAILED) {
+            if(optSt.verbosityLevel >= 1) {
+                fprintf(stderr,"Could not map book file into memory, seeking to offsets instead: %s\n", strerror(errno));
+            }
+            bkFilSt.bkFilMap = NULL;
+        }
+        
+        if(optSt.ioUring && !startBookUring(&bkFilSt)) {
+            if(optSt.verbosityLevel >= 1) {
+                fprintf(stderr,"Could not set up io_uring, reading the book file the usual way instead: %s\n", strerror(errno));
+            }
+        }
         
         /*Set buffer sizes*/
         if(!optSt.extrFilBufSizeGiven)
             extrFilSt.extrFilBufSize = DEFAULT_BUFFER_SIZE * sizeof(byte_t);
     
+        /* The header is read first, into a coded buffer just large enough for it, since 
+         * book_code_buffer is sized in offsets of the width it gives
+         */
+        bkCdSt.bkCdCodedBufSize = BOOK_CODE_HEADER_SIZE + MAX_VARINT_BYTES;
+        bkCdSt.bkCdCodedBuffer = malloc(bkCdSt.bkCdCodedBufSize);
+        if (bkCdSt.bkCdCodedBuffer == NULL) {
+            PRINT_SYS_ERROR(errno);
+            exit(EXIT_FAILURE);
+        }
+        
+        readBookCodeHeader(&bkCdSt);
+        
         if(!optSt.bkCdBufSizeGiven)
             bkCdSt.bkCdBufSize = DEFAULT_BUFFER_SIZE * sizeof(byte_t);
+        else
+            bkCdSt.bkCdBufSize /= bkCdSt.bkCdOffsetBytes;
         
-        if(!optSt.readFromStdin) {    
-            /*Check sizes between file sizes*/
-            if(bkCdSt.bkCdBufSize > bkCdSt.bkCdSize) {
-                bkCdSt.bkCdBufSize = bkCdSt.bkCdSize;
-            }
+        /*Check sizes between file sizes*/
+        if(!optSt.readFromStdin && bkCdSt.bkCdBufSize > bkCdSt.bkCdSize) {
+            bkCdSt.bkCdBufSize = bkCdSt.bkCdSize;
+        }
+        
+        /* Multiply the size of the bookcode buffer since it will be holding uoffset_t sized offsets
+         * that represent each byte of the original file we want to extract. This is important 
+         * becase the loop in extractBytes makes each uoffset_t sizd chunk of the book code 
+         * corespond to one byte of the extracted file buffer it indexes.
+         */    
+        bkCdSt.bkCdBufSize *= sizeof(oSetSt.byteOffset);
+        
+        /* It must hold at least one offset */
+        if(bkCdSt.bkCdBufSize < sizeof(oSetSt.byteOffset)) {
+            bkCdSt.bkCdBufSize = sizeof(oSetSt.byteOffset);
+        }
+        
+        /* The extracted file buffer needs a byte for every offset the book code buffer can hold */
+        if(extrFilSt.extrFilBufSize < bkCdSt.bkCdBufSize / sizeof(oSetSt.byteOffset)) {
+            extrFilSt.extrFilBufSize = bkCdSt.bkCdBufSize / sizeof(oSetSt.byteOffset);
+        }
+        
+        size_t gatherSize = 0;
+        if(optSt.sortedGather) {
+            if(!optSt.bkFilBufSizeGiven)
+                bkFilSt.bkFilBufSize = DEFAULT_BUFFER_SIZE * sizeof(byte_t);
+            
+            if(bkFilSt.bkFilBufSize == 0)
+                bkFilSt.bkFilBufSize = 1;
             
-            /* Multiply the size of the bookcode buffer since it will be holding uoffset_t sized offsets
-             * that represent each byte of the original file we want to extract. This is important 
-             * becase the loop in extractBytes makes each uoffset_t sizd chunk of the book code 
-             * corespond to one byte of the extracted file buffer it indexes.
-             */    
-            bkCdSt.bkCdBufSize *= sizeof(oSetSt.byteOffset);
+            gatherSize = bkFilSt.bkFilBufSize + 2 * (bkCdSt.bkCdBufSize / sizeof(oSetSt.byteOffset)) * sizeof(struct gatherPairStruct);
+        } else if(bkFilSt.bkFilUring != NULL) {
+            gatherSize = IO_URING_QUEUE_DEPTH * IO_URING_PAGE_SIZE + 2 * (bkCdSt.bkCdBufSize / sizeof(oSetSt.byteOffset)) * sizeof(struct gatherPairStruct);
         }
         
         if(optSt.verbosityLevel >= 1) {
-            fprintf(stderr,"extracted_file_buffer %lu bytes\nbook_code_buffer %lu bytes\n", (uint64_t)extrFilSt.extrFilBufSize, (uint64_t)bkCdSt.bkCdBufSize);
+            fprintf(stderr,"extracted_file_buffer %lu bytes\nbook_code_buffer %lu offsets\n", (uint64_t)extrFilSt.extrFilBufSize, (uint64_t)(bkCdSt.bkCdBufSize / sizeof(oSetSt.byteOffset)));
+            if(optSt.sortedGather) {
+                fprintf(stderr,"book_file_buffer %lu bytes\n", (uint64_t)bkFilSt.bkFilBufSize);
+            }
         }
         
         /*Check available memory*/
-        if((bkCdSt.bkCdBufSize + extrFilSt.extrFilBufSize) > bytesOfRamAvailable()) {
+        if((bkCdSt.bkCdBufSize + extrFilSt.extrFilBufSize + gatherSize) > bytesOfRamAvailable()) {
             printf("Not enough available memory for specified buffer size\n");
             exit(EXIT_FAILURE);
         }
@@ -954,13 +5523,96 @@ int main(int argc, char *argv[])
             exit(EXIT_FAILURE);
         }
         
+        /* Encoded offsets are read into the coded buffer first and then decoded into the book code 
+         * buffer. It still holds the first bytes of a raw book code that has no header.
+         */
+        if(bkCdSt.bkCdBufSize > bkCdSt.bkCdCodedBufSize) {
+            bkCdSt.bkCdCodedBufSize = bkCdSt.bkCdBufSize;
+            bkCdSt.bkCdCodedBuffer = realloc(bkCdSt.bkCdCodedBuffer, bkCdSt.bkCdCodedBufSize);
+            if (bkCdSt.bkCdCodedBuffer == NULL) {
+                PRINT_SYS_ERROR(errno);
+                exit(EXIT_FAILURE);
+            }
+        }
+        
+        if(bkCdSt.bkCdCompression != BOOK_CODE_UNCOMPRESSED) {
+            startBookCodeCompression(&bkCdSt, 0, 1, true);
+        }
+        
+        if(optSt.verbosityLevel >= 1) {
+            fprintf(stderr,"Book code format is %s%s\n", bookCodeFormatName(bkCdSt.bkCdFormat), bkCdSt.bkCdCompression != BOOK_CODE_UNCOMPRESSED ? ", compressed with xz" : "");
+        }
+        
+        /* Containers and book codes with a version 3 header record the book file they were mapped 
+         * with, so extracting with another one is caught before it can write garbage
+         */
+        if(bkCdSt.bkCdBookRecorded) {
+            struct bookCodeContainerStruct *container = &bkCdSt.bkCdContainerHeader;
+            
+            if(container->bkFilSize != bkFilSt.bkFilSize) {
+                fprintf(stderr,"The book code was mapped with a book file of %lu bytes, but %s is %lu bytes\n", (uint64_t)container->bkFilSize, bkFilSt.bkFilName, (uint64_t)bkFilSt.bkFilSize);
+                exit(EXIT_FAILURE);
+            }
+            
+            /* A book file of the right size can still be the wrong one, which would only show 
+             * once everything had been extracted from it
+             */
+            if(!optSt.noVerify) {
+                if(optSt.verbosityLevel >= 1) {
+                    fprintf(stderr,"Hashing book file...\n");
+                }
+                
+                uint64_t bkFilHash = hashFile(bkFilSt.bkFilName, optSt.threadCount > 1 ? optSt.threadCount : (int)lzma_cputhreads(), NULL, 0);
+                if(bkFilHash != container->bkFilHash) {
+                    fprintf(stderr,"The book code was mapped with a book file with hash %016lx, but %s has hash %016lx\n", (uint64_t)container->bkFilHash, bkFilSt.bkFilName, (uint64_t)bkFilHash);
+                    exit(EXIT_FAILURE);
+                }
+            }
+        }
+        
+        if(bkCdSt.bkCdContainer) {
+            struct bookCodeContainerStruct *container = &bkCdSt.bkCdContainerHeader;
+            
+            /* The block index can only be read from the end of a book code that can be seeked in */
+            if(!optSt.readFromStdin) {
+                readBlockIndex(&bkCdSt);
+                
+                /* Each worker decoding blocks holds a whole block of offsets, encoded and decoded */
+                if(optSt.threadCount > 1 && (size_t)optSt.threadCount * container->blockOffsets * (2 * sizeof(uoffset_t) + 1) > bytesOfRamAvailable()) {
+                    printf("Not enough available memory for specified buffer size\n");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            
+            if(optSt.verbosityLevel >= 1) {
+                fprintf(stderr,"Book code is a container of %lu blocks of %lu offsets, for an original file of %lu bytes\n", (uint64_t)((container->orgFilSize + container->blockOffsets - 1) / container->blockOffsets), (uint64_t)container->blockOffsets, (uint64_t)container->orgFilSize);
+            }
+        }
+        
+        bkFilSt.bkFilBuffer = NULL;
+        bkFilSt.bkFilGatherPairs = NULL;
+        bkFilSt.bkFilGatherPairsTmp = NULL;
+        if(optSt.sortedGather) {
+            bkFilSt.bkFilBuffer = malloc(bkFilSt.bkFilBufSize);
+            if (bkFilSt.bkFilBuffer == NULL) {
+                PRINT_SYS_ERROR(errno);
+                exit(EXIT_FAILURE);
+            }
+        }
+        if(optSt.sortedGather || bkFilSt.bkFilUring != NULL) {
+            bkFilSt.bkFilGatherPairs = malloc((bkCdSt.bkCdBufSize / sizeof(oSetSt.byteOffset)) * sizeof(struct gatherPairStruct));
+            bkFilSt.bkFilGatherPairsTmp = malloc((bkCdSt.bkCdBufSize / sizeof(oSetSt.byteOffset)) * sizeof(struct gatherPairStruct));
+            if (bkFilSt.bkFilGatherPairs == NULL || bkFilSt.bkFilGatherPairsTmp == NULL) {
+                PRINT_SYS_ERROR(errno);
+                exit(EXIT_FAILURE);
+            }
+        }
+        
         if(optSt.verbosityLevel >= 1) {
             fprintf(stderr,"Extracting bytes...\n");
         }
-        extractBytes(&bkFilSt,&bkCdSt,&extrFilSt,&oSetSt,&optSt);
+        extractBytes(&bkFilSt,&bkCdSt,&extrFilSt,&optSt);
 
-        fprintf(stderr,"Original file extracted from book code\n");
-        
         if(fclose(bkFilSt.bkFil) != 0) {
             PRINT_FILE_ERROR(bkFilSt.bkFilName,errno);
         }
@@ -971,8 +5623,44 @@ int main(int argc, char *argv[])
             PRINT_FILE_ERROR(extrFilSt.extrFilName,errno);
         }
         
+        /* Only a whole original file can be checked against its hash, which it doesn't need to be if 
+         * every block of it was already checked against its checksum as it was extracted. A book code 
+         * read from standard input can't have its blocks checked until its index has gone by, so it 
+         * is only known to be right once this passes, and nothing is reported as extracted before then
+         */
+        if(bkCdSt.bkCdBlockCount > 0 && bkCdSt.bkCdBlocks != NULL && bkCdSt.bkCdBlocksChecked == bkCdSt.bkCdBlockCount) {
+            fprintf(stderr,"Extracted file matches the checksums of all %lu blocks of the original file\n", (uint64_t)bkCdSt.bkCdBlockCount);
+        } else if(bkCdSt.bkCdContainer && !optSt.noVerify && !optSt.rangeGiven) {
+            if(optSt.verbosityLevel >= 1) {
+                fprintf(stderr,"Hashing extracted file...\n");
+            }
+            
+            uint64_t extrFilHash = hashFile(extrFilSt.extrFilName, optSt.threadCount > 1 ? optSt.threadCount : (int)lzma_cputhreads(), NULL, 0);
+            if(extrFilHash != bkCdSt.bkCdContainerHeader.orgFilHash) {
+                fprintf(stderr,"The extracted file has hash %016lx, but the original file had hash %016lx, so the book code or book file is damaged\n", (uint64_t)extrFilHash, (uint64_t)bkCdSt.bkCdContainerHeader.orgFilHash);
+                exit(EXIT_FAILURE);
+            }
+            
+            fprintf(stderr,"Extracted file matches the hash of the original file\n");
+        }
+        
+        fprintf(stderr,"Original file extracted from book code\n");
+        
+        if(bkFilSt.bkFilMap != NULL) {
+            munmap(bkFilSt.bkFilMap, bkFilSt.bkFilSize);
+        }
+        
         free(extrFilSt.extrFilBuffer);
         free(bkCdSt.bkCdBuffer);
+        free(bkCdSt.bkCdCodedBuffer);
+        if(bkCdSt.bkCdCompression != BOOK_CODE_UNCOMPRESSED) {
+            stopBookCodeCompression(&bkCdSt);
+        }
+        free(bkCdSt.bkCdBlocks);
+        free(bkFilSt.bkFilBuffer);
+        free(bkFilSt.bkFilGatherPairs);
+        free(bkFilSt.bkFilGatherPairsTmp);
+        stopBookUring(&bkFilSt);
         
         exit(EXIT_SUCCESS);
     }